@@ -55,11 +55,7 @@ static void _cmd_version(struct otr_user_state *ustate, SERVER_REC *irssi,
 	IRSSI_INFO(NULL, NULL, "OTR module version: " VERSION);
 }
 
-/*
- * /otr help 
- */
-static void _cmd_help(struct otr_user_state *ustate, SERVER_REC *irssi,
-		const char *target, const void *data)
+static void help_cb(void *data)
 {
 	int ret;
 	char *cmd_line;
@@ -70,11 +66,21 @@ static void _cmd_help(struct otr_user_state *ustate, SERVER_REC *irssi,
 	}
 
 	/* Call /help otr instread of duplicating the text output. */
-	signal_emit("send command", 3, cmd_line, irssi, NULL);
+	signal_emit("send command", 3, cmd_line, data, NULL);
 
 	free(cmd_line);
 }
 
+/*
+ * /otr help 
+ */
+static void _cmd_help(struct otr_user_state *ustate, SERVER_REC *irssi,
+		const char *target, const void *data)
+{
+	/* Commands run on the worker, Irssi is called from the main loop. */
+	worker_defer(help_cb, irssi, NULL);
+}
+
 /*
  * /otr finish 
  */
@@ -106,14 +112,15 @@ static void _cmd_trust(struct otr_user_state *ustate, SERVER_REC *irssi,
 
 	utils_explode_args(data, &argv, &argc);
 
-	if (argc == 5) {
-		utils_hash_parts_to_readable_hash((const char **) argv, str_fp);
+	if (argc > 0 && argc <= 5) {
+		utils_hash_parts_to_readable_hash((const char **) argv, argc, str_fp);
 		fp = str_fp;
 	} else if (!irssi || (irssi && argc != 0)) {
-		/* If no IRSSI or some arguments (not 5), bad command. */
+		/* If no IRSSI or too many arguments, bad command. */
 		IRSSI_NOTICE(irssi, target, "Usage %9/otr trust [FP]%9 "
 				"where FP is the five part of the fingerprint listed by "
-				"%9/otr contexts%9 or do the command inside an OTR session "
+				"%9/otr contexts%9, or a unique leading part of it, or do the "
+				"command inside an OTR session "
 				"private message window.");
 		goto end;
 	}
@@ -145,7 +152,9 @@ end:
 }
 
 /*
- * /otr genkey mynick@irc.server.net
+ * /otr genkey [-cancel] [mynick@irc.server.net]
+ *
+ * Without account name, the state of the key generations is printed.
  */
 static void _cmd_genkey(struct otr_user_state *ustate, SERVER_REC *irssi,
 		const char *target, const void *data)
@@ -155,7 +164,9 @@ static void _cmd_genkey(struct otr_user_state *ustate, SERVER_REC *irssi,
 
 	utils_explode_args(data, &argv, &argc);
 
-	if (argc) {
+	if (argc && strcmp(argv[0], "-cancel") == 0) {
+		key_gen_cancel(argc > 1 ? argv[1] : NULL);
+	} else if (argc) {
 		if (strchr(argv[0], '@')) {
 			key_gen_run(ustate, argv[0]);
 		} else {
@@ -163,8 +174,7 @@ static void _cmd_genkey(struct otr_user_state *ustate, SERVER_REC *irssi,
 					"Try something like /otr genkey mynick@irc.server.net");
 		}
 	} else {
-		IRSSI_INFO(NULL, NULL, "I need an account name. "
-				"Try something like /otr genkey mynick@irc.server.net");
+		key_gen_print_status();
 	}
 
 	utils_free_args(&argv, argc);
@@ -274,7 +284,7 @@ static void _cmd_init(struct otr_user_state *ustate, SERVER_REC *irssi,
 	 * Irssi does not handle well the HTML tag in the default OTR query message
 	 * so just send the OTR tag instead. Contact me for a better fix! :)
 	 */
-	irssi_send_message(irssi, target, "?OTRv23?");
+	otr_queue_message(irssi, target, "?OTRv23?", OTR_SCHED_CONTROL);
 
 end:
 	return;
@@ -292,14 +302,15 @@ static void _cmd_forget(struct otr_user_state *ustate, SERVER_REC *irssi,
 
 	utils_explode_args(data, &argv, &argc);
 
-	if (argc == 5) {
-		utils_hash_parts_to_readable_hash((const char **) argv, str_fp);
+	if (argc > 0 && argc <= 5) {
+		utils_hash_parts_to_readable_hash((const char **) argv, argc, str_fp);
 		fp = str_fp;
 	} else if (!irssi || (irssi && argc != 0)) {
-		/* If no IRSSI or some arguments (not 5), bad command. */
+		/* If no IRSSI or too many arguments, bad command. */
 		IRSSI_NOTICE(irssi, target, "Usage %9/otr forget [FP]%9 "
 				"where FP is the five part of the fingerprint listed by "
-				"%9/otr contexts%9 or do the command inside an OTR session "
+				"%9/otr contexts%9, or a unique leading part of it, or do the "
+				"command inside an OTR session "
 				"private message window");
 		goto error;
 	}
@@ -324,14 +335,15 @@ static void _cmd_distrust(struct otr_user_state *ustate, SERVER_REC *irssi,
 
 	utils_explode_args(data, &argv, &argc);
 
-	if (argc == 5) {
-		utils_hash_parts_to_readable_hash((const char **) argv, str_fp);
+	if (argc > 0 && argc <= 5) {
+		utils_hash_parts_to_readable_hash((const char **) argv, argc, str_fp);
 		fp = str_fp;
 	} else if (!irssi || (irssi && argc != 0)) {
-		/* If no IRSSI or some arguments (not 5), bad command. */
+		/* If no IRSSI or too many arguments, bad command. */
 		IRSSI_NOTICE(irssi, target, "Usage %9/otr distrust [FP]%9 "
 				"where FP is the five part of the fingerprint listed by "
-				"%9/otr contexts%9 or do the command inside an OTR session "
+				"%9/otr contexts%9, or a unique leading part of it, or do the "
+				"command inside an OTR session "
 				"private message window");
 		goto error;
 	}
@@ -352,18 +364,27 @@ static void _cmd_info(struct otr_user_state *ustate, SERVER_REC *irssi,
 {
 	unsigned int fp_found = 0;
 	char ownfp[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
+	GList *states, *tmp;
 	OtrlPrivKey *key;
+	OtrlUserState us;
 
-	for (key = user_state_global->otr_state->privkey_root; key != NULL;
-			key = key->next) {
-		otrl_privkey_fingerprint(user_state_global->otr_state, ownfp,
-				key->accountname, OTR_PROTOCOL_ID);
-		IRSSI_NOTICE(irssi, target, "%B%s%n fingerprint:",
-				key->accountname, ownfp);
-		IRSSI_NOTICE(irssi, target, "%g%s%n", ownfp);
-		fp_found = 1;
+	states = otr_user_state_list(ustate);
+
+	for (tmp = states; tmp; tmp = tmp->next) {
+		us = ((struct otr_user_state *) tmp->data)->otr_state;
+
+		for (key = us->privkey_root; key != NULL; key = key->next) {
+			otrl_privkey_fingerprint(us, ownfp, key->accountname,
+					OTR_PROTOCOL_ID);
+			IRSSI_NOTICE(irssi, target, "%B%s%n fingerprint:",
+					key->accountname, ownfp);
+			IRSSI_NOTICE(irssi, target, "%g%s%n", ownfp);
+			fp_found = 1;
+		}
 	}
 
+	g_list_free(states);
+
 	if (!fp_found) {
 		IRSSI_NOTICE(irssi, target, "No key found!");
 	}
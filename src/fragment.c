@@ -0,0 +1,542 @@
+/*
+ * Off-the-Record Messaging (OTR) modules for IRC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301,USA
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fragment.h"
+#include "otr.h"
+
+/*
+ * Memory allocated by all reassembly buffers.
+ */
+static size_t fragment_mem;
+
+/*
+ * Queues with pending buffers, least recently active first.
+ */
+static GQueue fragment_lru;
+
+/*
+ * Parsed header of an OTR fragment.
+ */
+struct fragment_header {
+	otrl_instag_t sender;
+	otrl_instag_t receiver;
+	unsigned short k;
+	unsigned short n;
+	/* Fragment data between the header and the end tag. */
+	const char *piece;
+	size_t piece_len;
+};
+
+static int has_prefix(const char *line, size_t len, const char *prefix)
+{
+	size_t prefix_len = strlen(prefix);
+
+	return len >= prefix_len && strncmp(line, prefix, prefix_len) == 0;
+}
+
+/*
+ * Return 1 if the OTR line ends with the end tag of its type.
+ */
+static int line_is_complete(const char *line, size_t len)
+{
+	char end_tag;
+
+	if (has_prefix(line, len, OTR_MSG_BEGIN_TAG)) {
+		end_tag = OTR_MSG_END_TAG;
+	} else {
+		end_tag = OTR_FRAGMENT_END_TAG;
+	}
+
+	return len > 0 && line[len - 1] == end_tag;
+}
+
+static void mem_account(struct otr_fragment_queue *queue, size_t old_size,
+		size_t new_size)
+{
+	queue->mem = queue->mem - old_size + new_size;
+	fragment_mem = fragment_mem - old_size + new_size;
+}
+
+/*
+ * Evict the least recently active queues, other than the given one, until an
+ * allocation of size bytes replacing old_size bytes fits in the global budget.
+ *
+ * Return 0 on success or else a negative value.
+ */
+static int mem_reserve(struct otr_fragment_queue *queue, size_t old_size,
+		size_t size)
+{
+	GList *link;
+	struct otr_fragment_queue *victim;
+
+	/* Per peer budget. */
+	if (queue->mem - old_size + size > OTR_FRAGMENT_PEER_MAX_BYTES) {
+		IRSSI_DEBUG("Fragment reassembly over peer budget of %d bytes",
+				OTR_FRAGMENT_PEER_MAX_BYTES);
+		goto error;
+	}
+
+	while (fragment_mem - old_size + size > OTR_FRAGMENT_MAX_BYTES) {
+		link = g_queue_peek_head_link(&fragment_lru);
+		if (link && link->data == queue) {
+			link = link->next;
+		}
+		if (!link) {
+			goto error;
+		}
+
+		victim = link->data;
+		IRSSI_DEBUG("Fragment reassembly over global budget. Evicting %lu "
+				"bytes", (unsigned long) victim->mem);
+		fragment_queue_clear(victim);
+	}
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/*
+ * Append len bytes of msg to the buffer. The buffer grows geometrically so a
+ * message split in many parts is copied only once.
+ *
+ * Return 0 on success or else a negative value and the buffer is released.
+ */
+static int buf_append(struct otr_fragment_queue *queue,
+		struct otr_fragment_buf *buf, const char *msg, size_t len)
+{
+	int ret;
+	size_t size;
+	char *tmp_ptr;
+
+	assert(queue);
+	assert(buf);
+	assert(msg);
+
+	if (len + 1 > buf->size - buf->len) {
+		size = buf->size ? buf->size : OTR_FRAGMENT_BUF_MIN_SIZE;
+		while (len + 1 > size - buf->len) {
+			size *= 2;
+		}
+
+		ret = mem_reserve(queue, buf->size, size);
+		if (ret < 0) {
+			goto error;
+		}
+
+		tmp_ptr = realloc(buf->data, size);
+		if (!tmp_ptr) {
+			ret = -1;
+			goto error;
+		}
+		mem_account(queue, buf->size, size);
+		buf->data = tmp_ptr;
+		buf->size = size;
+	}
+
+	memcpy(buf->data + buf->len, msg, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+
+	return 0;
+
+error:
+	mem_account(queue, buf->size, 0);
+	free(buf->data);
+	memset(buf, 0, sizeof(*buf));
+	return ret;
+}
+
+/*
+ * Return the data of the buffer to the caller which must free(3) it.
+ */
+static char *buf_steal(struct otr_fragment_queue *queue,
+		struct otr_fragment_buf *buf)
+{
+	char *data = buf->data;
+
+	mem_account(queue, buf->size, 0);
+	memset(buf, 0, sizeof(*buf));
+	return data;
+}
+
+static void buf_release(struct otr_fragment_queue *queue,
+		struct otr_fragment_buf *buf)
+{
+	mem_account(queue, buf->size, 0);
+	free(buf->data);
+	memset(buf, 0, sizeof(*buf));
+}
+
+static void slot_release(struct otr_fragment_queue *queue,
+		struct otr_fragment_slot *slot)
+{
+	buf_release(queue, &slot->buf);
+	memset(slot, 0, sizeof(*slot));
+}
+
+/*
+ * Update the position of the queue in the LRU list after activity.
+ */
+static void queue_touch(struct otr_fragment_queue *queue)
+{
+	queue->last_update = time(NULL);
+
+	if (queue->lru_link) {
+		g_queue_unlink(&fragment_lru, queue->lru_link);
+		if (!queue->mem) {
+			g_list_free_1(queue->lru_link);
+			queue->lru_link = NULL;
+			return;
+		}
+	} else if (queue->mem) {
+		queue->lru_link = g_list_alloc();
+		queue->lru_link->data = queue;
+	} else {
+		return;
+	}
+
+	g_queue_push_tail_link(&fragment_lru, queue->lru_link);
+}
+
+/*
+ * Find the slot reassembling fragments of the given sender instance.
+ */
+static struct otr_fragment_slot *slot_find(struct otr_fragment_queue *queue,
+		otrl_instag_t instag)
+{
+	int i;
+
+	for (i = 0; i < OTR_FRAGMENT_MAX_SLOTS; i++) {
+		if (queue->slots[i].k && queue->slots[i].instag == instag) {
+			return &queue->slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Get a free slot or recycle the least recently used one.
+ */
+static struct otr_fragment_slot *slot_get(struct otr_fragment_queue *queue)
+{
+	int i;
+	struct otr_fragment_slot *slot = &queue->slots[0];
+
+	for (i = 0; i < OTR_FRAGMENT_MAX_SLOTS; i++) {
+		if (!queue->slots[i].k) {
+			return &queue->slots[i];
+		}
+		if (queue->slots[i].stamp < slot->stamp) {
+			slot = &queue->slots[i];
+		}
+	}
+
+	IRSSI_DEBUG("Fragment slot of instance %u recycled", slot->instag);
+	slot_release(queue, slot);
+
+	return slot;
+}
+
+/*
+ * Parse the header of a version 2 or 3 OTR fragment, up to the comma
+ * preceding the piece.
+ *
+ * Return the offset of the piece on success or else a negative value.
+ */
+static int parse_prefix(const char *line, size_t len,
+		struct fragment_header *hdr)
+{
+	int ret, start = 0;
+
+	memset(hdr, 0, sizeof(*hdr));
+
+	if (has_prefix(line, len, OTR_FRAGMENT_V3_TAG)) {
+		ret = sscanf(line, "?OTR|%x|%x,%hu,%hu,%n", &hdr->sender,
+				&hdr->receiver, &hdr->k, &hdr->n, &start);
+		if (ret != 4) {
+			goto error;
+		}
+	} else if (has_prefix(line, len, OTR_FRAGMENT_V2_TAG)) {
+		ret = sscanf(line, "?OTR,%hu,%hu,%n", &hdr->k, &hdr->n, &start);
+		if (ret != 2) {
+			goto error;
+		}
+	} else {
+		goto error;
+	}
+
+	if (start <= 0 || (size_t) start > len) {
+		goto error;
+	}
+
+	if (hdr->k == 0 || hdr->n == 0 || hdr->k > hdr->n) {
+		goto error;
+	}
+
+	return start;
+
+error:
+	return -1;
+}
+
+/*
+ * Parse the header of a complete version 2 or 3 OTR fragment.
+ *
+ * Return 0 on success or else a negative value.
+ */
+static int parse_header(const char *line, size_t len,
+		struct fragment_header *hdr)
+{
+	int start;
+
+	start = parse_prefix(line, len, hdr);
+	if (start < 0) {
+		goto error;
+	}
+
+	/* The piece is followed by the end tag. */
+	if ((size_t) start >= len || line[len - 1] != OTR_FRAGMENT_END_TAG) {
+		goto error;
+	}
+
+	hdr->piece = line + start;
+	hdr->piece_len = len - start - 1;
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/*
+ * Return 1 if the line is the beginning of an OTR line split by the server:
+ * an OTR message without its end tag or a fragment with a valid header but
+ * no end tag. A human typing "?OTR, what's that" does not start one.
+ */
+static int line_is_partial(const char *line, size_t len)
+{
+	struct fragment_header hdr;
+
+	if (has_prefix(line, len, OTR_MSG_BEGIN_TAG)) {
+		return !line_is_complete(line, len);
+	}
+
+	return parse_prefix(line, len, &hdr) >= 0 &&
+		!line_is_complete(line, len);
+}
+
+/*
+ * Add a complete fragment line to the slot of its sender instance.
+ */
+static enum otr_msg_status fragment_add(struct otr_fragment_queue *queue,
+		const char *line, size_t len, otrl_instag_t our_instag,
+		char **full_msg)
+{
+	int ret;
+	struct fragment_header hdr;
+	struct otr_fragment_slot *slot;
+
+	ret = parse_header(line, len, &hdr);
+	if (ret < 0) {
+		/* Not a valid fragment. Let libotr deal with it. */
+		return OTR_MSG_ORIGINAL;
+	}
+
+	/* Fragments for another instance of our account are of no use here. */
+	if (hdr.receiver && our_instag && hdr.receiver != our_instag) {
+		IRSSI_DEBUG("Dropping fragment for instance %u", hdr.receiver);
+		return OTR_MSG_DROP;
+	}
+
+	slot = slot_find(queue, hdr.sender);
+	if (hdr.k == 1) {
+		/* First fragment, restart reassembly for this sender. */
+		if (slot) {
+			slot_release(queue, slot);
+		} else {
+			slot = slot_get(queue);
+		}
+		slot->instag = hdr.sender;
+		slot->n = hdr.n;
+	} else if (!slot || slot->n != hdr.n || slot->k + 1 != hdr.k) {
+		IRSSI_DEBUG("Dropping out of sequence fragment %d/%d of "
+				"instance %u", hdr.k, hdr.n, hdr.sender);
+		if (slot) {
+			slot_release(queue, slot);
+		}
+		return OTR_MSG_DROP;
+	}
+
+	ret = buf_append(queue, &slot->buf, hdr.piece, hdr.piece_len);
+	if (ret < 0) {
+		slot_release(queue, slot);
+		return OTR_MSG_ERROR;
+	}
+	slot->k = hdr.k;
+	slot->stamp = ++queue->stamp;
+
+	if (hdr.k < hdr.n) {
+		return OTR_MSG_WAIT_MORE;
+	}
+
+	*full_msg = buf_steal(queue, &slot->buf);
+	slot_release(queue, slot);
+
+	return OTR_MSG_USE_QUEUE;
+}
+
+/*
+ * For the given message we received through irssi, check if we need to queue
+ * it for the case where that message is part of a bigger OTR full message.
+ * This can happen with bitlbee for instance where OTR message are split in
+ * different PRIVMSG, or with OTR protocol fragments.
+ *
+ * Return an otr_msg_status code indicating the caller what to do with the msg.
+ * OTR_MSG_ERROR indicates an error probably memory related. OTR_MSG_WAIT_MORE
+ * tells the caller to NOT send out the message since we are waiting for more
+ * to complete the OTR original message. OTR_MSG_DROP tells the caller the
+ * message is a fragment we can't use and must be ignored. OTR_MSG_ORIGINAL
+ * tell the caller to simply use the original message. OTR_MSG_USE_QUEUE
+ * indicates that full_msg can be used containing the reconstructed message.
+ * The caller SHOULD free(3) this pointer after use.
+ */
+enum otr_msg_status fragment_enqueue(struct otr_fragment_queue *queue,
+		const char *msg, otrl_instag_t our_instag, char **full_msg)
+{
+	int ret_append;
+	enum otr_msg_status ret;
+	size_t len;
+	const char *line;
+	char *joined = NULL;
+
+	assert(queue);
+	assert(msg);
+	assert(full_msg);
+
+	len = strlen(msg);
+	line = msg;
+
+	if (queue->line.len) {
+		/* Continuation of a line split by the server. */
+		ret_append = buf_append(queue, &queue->line, msg, len);
+		if (ret_append < 0) {
+			ret = OTR_MSG_ERROR;
+			goto end;
+		}
+
+		IRSSI_DEBUG("Partial OTR message added to queue: %s", msg);
+
+		if (!line_is_complete(queue->line.data, queue->line.len)) {
+			ret = OTR_MSG_WAIT_MORE;
+			goto end;
+		}
+
+		len = queue->line.len;
+		joined = buf_steal(queue, &queue->line);
+		line = joined;
+	} else if (line_is_partial(msg, len)) {
+		ret_append = buf_append(queue, &queue->line, msg, len);
+		if (ret_append < 0) {
+			ret = OTR_MSG_ERROR;
+			goto end;
+		}
+
+		IRSSI_DEBUG("Partial OTR message begins the queue: %s", msg);
+		ret = OTR_MSG_WAIT_MORE;
+		goto end;
+	}
+
+	if (!has_prefix(line, len, OTR_MSG_BEGIN_TAG)) {
+		ret = fragment_add(queue, line, len, our_instag, full_msg);
+		if (ret != OTR_MSG_ORIGINAL) {
+			goto end;
+		}
+	}
+
+	if (joined) {
+		/* Hand over the joined line to the caller which frees it. */
+		*full_msg = joined;
+		joined = NULL;
+		ret = OTR_MSG_USE_QUEUE;
+	} else {
+		ret = OTR_MSG_ORIGINAL;
+	}
+
+end:
+	free(joined);
+	queue_touch(queue);
+	return ret;
+}
+
+/*
+ * Free all reassembly buffers of the queue.
+ */
+void fragment_queue_clear(struct otr_fragment_queue *queue)
+{
+	int i;
+
+	assert(queue);
+
+	buf_release(queue, &queue->line);
+
+	for (i = 0; i < OTR_FRAGMENT_MAX_SLOTS; i++) {
+		slot_release(queue, &queue->slots[i]);
+	}
+
+	if (queue->lru_link) {
+		g_queue_delete_link(&fragment_lru, queue->lru_link);
+		queue->lru_link = NULL;
+	}
+}
+
+/*
+ * Drop the incomplete messages not updated for OTR_FRAGMENT_TIMEOUT seconds.
+ */
+void fragment_expire(void)
+{
+	time_t now = time(NULL);
+	GList *link;
+	struct otr_fragment_queue *queue;
+
+	while ((link = g_queue_peek_head_link(&fragment_lru))) {
+		queue = link->data;
+		if (now - queue->last_update < OTR_FRAGMENT_TIMEOUT) {
+			break;
+		}
+
+		IRSSI_DEBUG("Incomplete OTR message expired. Dropping %lu bytes",
+				(unsigned long) queue->mem);
+		fragment_queue_clear(queue);
+	}
+}
+
+/*
+ * Return the memory allocated by all pending reassembly buffers.
+ */
+size_t fragment_mem_usage(void)
+{
+	return fragment_mem;
+}
@@ -0,0 +1,118 @@
+/*
+ * Off-the-Record Messaging (OTR) modules for IRC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301,USA
+ */
+
+#ifndef IRSSI_OTR_FRAGMENT_H
+#define IRSSI_OTR_FRAGMENT_H
+
+#include <glib.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <libotr/instag.h>
+
+/*
+ * Fragment tags specified in OTR protocol version 2 and 3. Each fragment is
+ * terminated by a comma.
+ */
+#define OTR_FRAGMENT_V2_TAG           "?OTR,"
+#define OTR_FRAGMENT_V3_TAG           "?OTR|"
+#define OTR_FRAGMENT_END_TAG          ','
+
+/* Initial size of a fragment reassembly buffer. */
+#define OTR_FRAGMENT_BUF_MIN_SIZE     1024
+
+/*
+ * Number of sender instances of a peer for which fragments can be reassembled
+ * at the same time. The least recently used one is recycled when full.
+ */
+#define OTR_FRAGMENT_MAX_SLOTS        4
+
+/*
+ * Memory budgets of pending reassembly buffers. A peer going over its budget
+ * has its pending message dropped. When the global budget is hit, the least
+ * recently active peers are evicted.
+ */
+#define OTR_FRAGMENT_PEER_MAX_BYTES   (64 * 1024)
+#define OTR_FRAGMENT_MAX_BYTES        (1024 * 1024)
+
+/* Seconds after which an incomplete message is dropped. */
+#define OTR_FRAGMENT_TIMEOUT          60
+/* Seconds between two expiry checks while messages are pending. */
+#define OTR_FRAGMENT_TIMER_INTERVAL   10
+
+enum otr_msg_status {
+	OTR_MSG_ORIGINAL		= 1,
+	OTR_MSG_WAIT_MORE		= 2,
+	OTR_MSG_USE_QUEUE		= 3,
+	OTR_MSG_ERROR			= 4,
+	OTR_MSG_DROP			= 5,
+};
+
+/*
+ * Growable reassembly buffer. The data is always NULL terminated.
+ */
+struct otr_fragment_buf {
+	char *data;
+	/* Allocated memory size. */
+	size_t size;
+	/* Len of the actual string NOT counting the NULL byte. */
+	size_t len;
+};
+
+/*
+ * OTR fragments of one sender instance being reassembled.
+ */
+struct otr_fragment_slot {
+	/* Sender instance tag. Zero for protocol version 2 fragments. */
+	otrl_instag_t instag;
+	/* Index of the last fragment received. Zero means the slot is free. */
+	unsigned short k;
+	/* Total number of fragments. */
+	unsigned short n;
+	/* Last use of the slot from the queue counter. */
+	unsigned long stamp;
+	struct otr_fragment_buf buf;
+};
+
+/*
+ * Reassembly state of a peer.
+ *
+ * Two levels are handled. An OTR message or fragment can be split in multiple
+ * PRIVMSG by the server (bitlbee for instance) so the line is glued back
+ * first. Complete fragments are then reassembled per sender instance.
+ */
+struct otr_fragment_queue {
+	/* Line split by the server waiting for its end tag. */
+	struct otr_fragment_buf line;
+	struct otr_fragment_slot slots[OTR_FRAGMENT_MAX_SLOTS];
+	unsigned long stamp;
+	/* Memory allocated by the buffers of this queue. */
+	size_t mem;
+	/* Time of the last fragment received. */
+	time_t last_update;
+	/* Link in the global LRU list if buffers are pending. */
+	GList *lru_link;
+};
+
+enum otr_msg_status fragment_enqueue(struct otr_fragment_queue *queue,
+		const char *msg, otrl_instag_t our_instag, char **full_msg);
+void fragment_queue_clear(struct otr_fragment_queue *queue);
+void fragment_expire(void);
+size_t fragment_mem_usage(void);
+
+#endif /* IRSSI_OTR_FRAGMENT_H */
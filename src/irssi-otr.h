@@ -41,6 +41,8 @@
 #include <irssi/src/irc/core/irc-servers.h>
 #include <irssi/src/fe-text/statusbar-item.h>
 
+#include "worker.h"
+
 /* Note: VERSION, PACKAGE_NAME, etc... defs will propogate from irssi's 
  * headers here so one may see redefined macro warnings when buiding,
  * so we clear there here and use the defs for "this" package. */
@@ -59,29 +61,42 @@
 
 #define OTR_IRSSI_MSG_PREFIX	"%9OTR%9: "
 
+/*
+ * Print text from the main loop. From the worker thread, the text is
+ * formatted right away and printed later by the main loop.
+ */
+#define IRSSI_PRINTTEXT(irssi, username, level, fmt, ...)                  \
+	do {                                                                    \
+		if (worker_in_thread()) {                                           \
+			worker_printtext(irssi, username, level, fmt, ## __VA_ARGS__);  \
+		} else {                                                            \
+			printtext(irssi, username, level, fmt, ## __VA_ARGS__);         \
+		}                                                                   \
+	} while (0)
+
 /*
  * Irssi macros for printing text to console.
  */
 #define IRSSI_MSG(fmt, ...)                                                 \
 	do {                                                                    \
-		printtext(NULL, NULL, MSGLEVEL_MSGS, OTR_IRSSI_MSG_PREFIX fmt,      \
-						## __VA_ARGS__);                                    \
+		IRSSI_PRINTTEXT(NULL, NULL, MSGLEVEL_MSGS,                          \
+				OTR_IRSSI_MSG_PREFIX fmt, ## __VA_ARGS__);                  \
 	} while (0)
 #define IRSSI_INFO(irssi, username, fmt, ...)                               \
 	do {                                                                    \
-		printtext(irssi, username, MSGLEVEL_CRAP, OTR_IRSSI_MSG_PREFIX fmt, \
-						## __VA_ARGS__);                                    \
+		IRSSI_PRINTTEXT(irssi, username, MSGLEVEL_CRAP,                     \
+				OTR_IRSSI_MSG_PREFIX fmt, ## __VA_ARGS__);                  \
 	} while (0)
 #define IRSSI_NOTICE(irssi, username, fmt, ...)                             \
 	do {                                                                    \
-		printtext(irssi, username, MSGLEVEL_MSGS, OTR_IRSSI_MSG_PREFIX fmt, \
-						## __VA_ARGS__);                                    \
+		IRSSI_PRINTTEXT(irssi, username, MSGLEVEL_MSGS,                     \
+				OTR_IRSSI_MSG_PREFIX fmt, ## __VA_ARGS__);                  \
 	} while (0)
 #define IRSSI_DEBUG(fmt, ...) \
 	do {                                                                    \
 		if (debug) {                                                        \
-			printtext(NULL, NULL, MSGLEVEL_MSGS, OTR_IRSSI_MSG_PREFIX fmt,  \
-						## __VA_ARGS__);                                    \
+			IRSSI_PRINTTEXT(NULL, NULL, MSGLEVEL_MSGS,                      \
+					OTR_IRSSI_MSG_PREFIX fmt, ## __VA_ARGS__);              \
 		}                                                                   \
 	} while (0)
 
@@ -21,26 +21,153 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <fcntl.h>
 #include <glib/gstdio.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include "key.h"
 
 /*
- * Key generation data for the thread in charge of creating the key.
+ * Upper bound of the key generation pool whatever the number of CPUs.
  */
-static struct key_gen_data key_gen_state = {
-	.status = KEY_GEN_IDLE,
-	.gcry_error = GPG_ERR_NO_ERROR,
+#define KEY_GEN_MAX_THREADS		4
+
+/*
+ * Key generation jobs, in request order. The list is only used by the thread
+ * running libotr, the lock protects the status and progress of the jobs.
+ */
+static GSList *key_gen_jobs;
+static unsigned int key_gen_running;
+static pthread_mutex_t key_gen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Job of the generation thread, for the libgcrypt progress handler. */
+static __thread struct key_gen_data *key_gen_self;
+
+/*
+ * Spare keys loaded from the pool file, NULL until the pool is enabled, and
+ * the number of keys to keep in it.
+ */
+static OtrlUserState key_pool_state;
+static unsigned int key_pool_size;
+static unsigned int key_pool_serial;
+
+/*
+ * Seconds during which fingerprint and instance tag writes are coalesced.
+ */
+#define KEY_WRITE_DELAY		2
+
+/*
+ * User state whose fingerprints or instance tags are waiting to be written,
+ * NULL if none. Only used by the thread running libotr. The timer is owned by
+ * the main loop.
+ */
+static struct otr_user_state *key_fp_dirty;
+static struct otr_user_state *key_instag_dirty;
+static guint key_write_timerid;
+
+/*
+ * Size past which the fingerprint journal is compacted into otr.fp.
+ */
+#define KEY_FP_JOURNAL_MAX_SIZE	(64 * 1024)
+
+/*
+ * Fingerprint as found on disk, in otr.fp and its journal.
+ */
+struct key_fp_record {
+	char *trust;
+	/* Pass of the last view update the fingerprint was seen in. */
+	unsigned int pass;
+};
+
+/*
+ * View of the fingerprints on disk keyed by the otr.fp line of the
+ * fingerprint without trust. In journal mode, the journal gets the difference
+ * between the user state and this view. The changes of other Irssi instances
+ * are found against it. NULL in lazy mode.
+ */
+static GHashTable *key_fp_view;
+static unsigned int key_fp_pass;
+static long key_fp_journal_size;
+static int key_fp_compact;
+
+/*
+ * Binary snapshot of otr.fp, loaded in place of it when otr.fp is exactly the
+ * file it was written after. Native byte order, checked by the header. Fixed
+ * width records follow the header and point in the string table following
+ * them.
+ */
+#define KEY_FP_BIN_MAGIC		"OTRFPBIN"
+#define KEY_FP_BIN_VERSION		2
+#define KEY_FP_BIN_BYTE_ORDER	0x01020304
+#define KEY_FP_BIN_NO_TRUST		UINT32_MAX
+
+struct key_fp_bin_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t count;
+	uint32_t strtab_size;
+	/* Identity of otr.fp when the snapshot was written. */
+	uint64_t text_dev;
+	uint64_t text_ino;
+	uint64_t text_size;
+	int64_t text_mtime_sec;
+	int64_t text_mtime_nsec;
+};
+
+struct key_fp_bin_record {
+	/* Offsets in the string table. */
+	uint32_t username;
+	uint32_t accountname;
+	uint32_t protocol;
+	uint32_t trust;
+	unsigned char fingerprint[20];
+};
+
+/* otr.fp was loaded from text, the snapshot has to be written again. */
+static int key_fp_bin_stale;
+
+/*
+ * Files shared with the other Irssi instances using the same directory.
+ */
+enum key_file {
+	KEY_FILE_KEYS		= 0,
+	KEY_FILE_FP			= 1,
+	KEY_FILE_FP_JOURNAL	= 2,
+	KEY_FILE_INSTAGS	= 3,
+	KEY_FILE_COUNT,
+};
+
+static const char *key_file_paths[KEY_FILE_COUNT] = {
+	OTR_KEYFILE,
+	OTR_FINGERPRINTS_FILE,
+	OTR_FINGERPRINTS_JOURNAL,
+	OTR_INSTAG_FILE,
+};
+
+/*
+ * Identity of a shared file as last read or written by this instance, any
+ * other means another instance wrote it. Only used by the thread running
+ * libotr.
+ */
+struct key_file_stamp {
+	int exists;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
 };
 
-static pthread_t keygen_thread;
+static struct key_file_stamp key_file_stamps[KEY_FILE_COUNT];
 
 /*
  * Build file path concatenate to the irssi config dir.
@@ -50,212 +177,2179 @@ static char *file_path_build(const char *path)
 	int ret;
 	char *filename;
 
-	if (!path) {
-		path = "";
+	if (!path) {
+		path = "";
+	}
+
+	/* Either NULL or the filename is returned here which is valid. */
+	ret = asprintf(&filename, "%s%s", get_client_config_dir(), path);
+	if (ret < 0) {
+		filename = NULL;
+	}
+
+	return filename;
+}
+
+/*
+ * Open a temporary file, readable by the user only, replacing filename once
+ * committed.
+ *
+ * Return the file or NULL with errno set.
+ */
+static FILE *file_replace_open(const char *filename, char **tmp_path)
+{
+	int ret;
+	mode_t mask;
+	FILE *fp;
+
+	ret = asprintf(tmp_path, "%s.tmp", filename);
+	if (ret < 0) {
+		*tmp_path = NULL;
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	mask = umask(077);
+	fp = fopen(*tmp_path, "wb");
+	umask(mask);
+	if (!fp) {
+		free(*tmp_path);
+		*tmp_path = NULL;
+	}
+
+	return fp;
+}
+
+/*
+ * Close a file opened by file_replace_open(). Without error so far, it is
+ * synced to disk and renamed over filename so readers never see a partial
+ * file. Else it is removed.
+ *
+ * Return the first error met.
+ */
+static gcry_error_t file_replace_commit(FILE *fp, char *tmp_path,
+		const char *filename, gcry_error_t err)
+{
+	int ret;
+
+	if (err == GPG_ERR_NO_ERROR &&
+			(fflush(fp) != 0 || fsync(fileno(fp)) < 0)) {
+		err = gcry_error_from_errno(errno);
+	}
+
+	ret = fclose(fp);
+	if (ret != 0 && err == GPG_ERR_NO_ERROR) {
+		err = gcry_error_from_errno(errno);
+	}
+
+	if (err == GPG_ERR_NO_ERROR) {
+		ret = rename(tmp_path, filename);
+		if (ret < 0) {
+			err = gcry_error_from_errno(errno);
+		}
+	}
+
+	if (err != GPG_ERR_NO_ERROR) {
+		unlink(tmp_path);
+	}
+
+	free(tmp_path);
+	return err;
+}
+
+/*
+ * Take the advisory lock of the OTR directory, shared by the Irssi instances
+ * using it: LOCK_SH to read the files, LOCK_EX to merge and write them. The
+ * lock does not nest since flock() locks belong to the open file.
+ *
+ * Return the lock descriptor for key_unlock() or a negative value, the caller
+ * then goes on without it.
+ */
+int key_lock(int operation)
+{
+	int fd, ret;
+	char *filename;
+
+	filename = file_path_build(OTR_LOCK_FILE);
+	if (!filename) {
+		fd = -1;
+		goto error_filename;
+	}
+
+	fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		IRSSI_DEBUG("Unable to open %9%s%9: %s", filename, strerror(errno));
+		goto end;
+	}
+
+	do {
+		ret = flock(fd, operation);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		IRSSI_DEBUG("Unable to lock %9%s%9: %s", filename, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+
+end:
+	free(filename);
+error_filename:
+	return fd;
+}
+
+void key_unlock(int fd)
+{
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+static void file_stamp_get(enum key_file file, struct key_file_stamp *stamp)
+{
+	char *filename;
+	struct stat st;
+
+	memset(stamp, 0, sizeof(*stamp));
+
+	filename = file_path_build(key_file_paths[file]);
+	if (!filename) {
+		return;
+	}
+
+	if (stat(filename, &st) == 0) {
+		stamp->exists = 1;
+		stamp->dev = st.st_dev;
+		stamp->ino = st.st_ino;
+		stamp->size = st.st_size;
+		stamp->mtime = st.st_mtim;
+	}
+
+	free(filename);
+}
+
+/*
+ * Return 1 if a shared file changed since this instance last read or wrote
+ * it. Files are replaced by renaming so the inode tells most writes apart.
+ */
+static int file_stamp_changed(enum key_file file)
+{
+	struct key_file_stamp now;
+	const struct key_file_stamp *last = &key_file_stamps[file];
+
+	file_stamp_get(file, &now);
+
+	return now.exists != last->exists || now.dev != last->dev ||
+		now.ino != last->ino || now.size != last->size ||
+		now.mtime.tv_sec != last->mtime.tv_sec ||
+		now.mtime.tv_nsec != last->mtime.tv_nsec;
+}
+
+/*
+ * Record a shared file as just read or written by this instance.
+ */
+static void file_stamp_update(enum key_file file)
+{
+	file_stamp_get(file, &key_file_stamps[file]);
+}
+
+/*
+ * Free a key generation job.
+ */
+static void key_gen_free(struct key_gen_data *job)
+{
+	free(job->key_file_path);
+	free(job->account_name);
+	free(job);
+}
+
+/*
+ * Return the job of an account or NULL.
+ */
+static struct key_gen_data *key_gen_find(const char *account_name)
+{
+	GSList *tmp;
+	struct key_gen_data *job;
+
+	for (tmp = key_gen_jobs; tmp; tmp = tmp->next) {
+		job = tmp->data;
+		if (!job->pool && strcmp(job->account_name, account_name) == 0) {
+			return job;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Return the libotr state a job was started in.
+ */
+static OtrlUserState key_gen_job_state(struct key_gen_data *job)
+{
+	struct otr_user_state *shard;
+
+	if (job->pool) {
+		return key_pool_state;
+	}
+
+	shard = otr_user_state_shard(job->ustate, job->account_name);
+	return shard ? shard->otr_state : NULL;
+}
+
+/*
+ * Drop the new key of a job from libotr and free the job.
+ */
+static void key_gen_discard(struct key_gen_data *job)
+{
+	otrl_privkey_generate_cancelled(key_gen_job_state(job), job->newkey);
+
+	key_gen_jobs = g_slist_remove(key_gen_jobs, job);
+	key_gen_free(job);
+}
+
+/*
+ * Number of generations run at once: one CPU is left to irssi.
+ */
+static unsigned int key_gen_pool_size(void)
+{
+	long cpus;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 2) {
+		return 1;
+	}
+
+	return MIN(cpus - 1, KEY_GEN_MAX_THREADS);
+}
+
+/*
+ * libgcrypt progress handler. It is global so it is routed to the job of the
+ * calling thread. A cancelled calculation is abandoned here by jumping back
+ * to generate_key(), libgcrypt holding no lock while reporting progress. What
+ * it allocated for the calculation is lost.
+ */
+static void key_gen_progress(void *data, const char *what, int printchar,
+		int current, int total)
+{
+	int cancelled;
+
+	if (!key_gen_self) {
+		return;
+	}
+
+	pthread_mutex_lock(&key_gen_lock);
+	key_gen_self->progress++;
+	cancelled = key_gen_self->cancelled;
+	pthread_mutex_unlock(&key_gen_lock);
+
+	if (cancelled) {
+		longjmp(key_gen_self->abort, 1);
+	}
+}
+
+/*
+ * Cancel a job, a running calculation stops at its next progress step.
+ */
+static void key_gen_set_cancelled(struct key_gen_data *job)
+{
+	pthread_mutex_lock(&key_gen_lock);
+	job->cancelled = 1;
+	pthread_mutex_unlock(&key_gen_lock);
+}
+
+static void key_gen_check_job(void *data)
+{
+	key_gen_check();
+}
+
+/*
+ * A generation thread is done. Called in the main loop which hands the
+ * completion to the thread running libotr.
+ */
+static void key_gen_done_cb(void *data)
+{
+	struct worker_job *job;
+
+	job = worker_job_new(key_gen_check_job, NULL, NULL);
+	if (!job) {
+		return;
+	}
+
+	worker_post(job);
+}
+
+/*
+ * Generate OTR key. Thread in the background.
+ *
+ * NOTE: NO irssi interaction should be done here like emitting signals or else
+ * it causes a segfaults of libperl.
+ */
+static void *generate_key(void *data)
+{
+	gcry_error_t err;
+	struct key_gen_data *job = data;
+
+	assert(job->newkey);
+
+#ifdef SCHED_IDLE
+	{
+		/* Only run when the CPU has nothing else to do. */
+		struct sched_param param = { .sched_priority = 0 };
+
+		(void) pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	}
+#endif
+
+	key_gen_self = job;
+
+	if (setjmp(job->abort) == 0) {
+		err = otrl_privkey_generate_calculate(job->newkey);
+	} else {
+		err = gcry_error(GPG_ERR_CANCELED);
+	}
+	key_gen_self = NULL;
+
+	pthread_mutex_lock(&key_gen_lock);
+	if (err != GPG_ERR_NO_ERROR) {
+		job->status = KEY_GEN_ERROR;
+		job->gcry_error = err;
+	} else {
+		job->status = KEY_GEN_FINISHED;
+	}
+	pthread_mutex_unlock(&key_gen_lock);
+
+	/*
+	 * Wake up the main loop to finish the key. Without wakeup pipe, it is
+	 * noticed by /otr genkey.
+	 */
+	(void) worker_notify(key_gen_done_cb, NULL, NULL);
+
+	return NULL;
+}
+
+/*
+ * Start the queued jobs while the pool has room, the accounts before the
+ * spare keys.
+ */
+static void key_gen_schedule(void)
+{
+	int ret, pool;
+	GSList *tmp;
+	struct key_gen_data *job;
+
+	for (pool = 0; pool <= 1; pool++) {
+		for (tmp = key_gen_jobs; tmp; tmp = tmp->next) {
+			if (key_gen_running >= key_gen_pool_size()) {
+				return;
+			}
+
+			job = tmp->data;
+			if (job->status != KEY_GEN_QUEUED || job->pool != pool) {
+				continue;
+			}
+
+			job->status = KEY_GEN_RUNNING;
+			job->start_time = time(NULL);
+
+			ret = pthread_create(&job->thread, NULL, generate_key, job);
+			if (ret != 0) {
+				/* Reported by the next check. */
+				job->status = KEY_GEN_ERROR;
+				job->gcry_error = gcry_error_from_errno(ret);
+				continue;
+			}
+
+			job->thread_started = 1;
+			key_gen_running++;
+			if (job->pool) {
+				IRSSI_DEBUG("Spare key generation started");
+			} else {
+				IRSSI_MSG("Key generation started for %9%s%n",
+						job->account_name);
+			}
+		}
+	}
+}
+
+/*
+ * Write the S-expression of a private key bound to an account.
+ */
+static gcry_error_t key_file_write_account(FILE *fp, const char *account_name,
+		const char *protocol, gcry_sexp_t privkey)
+{
+	char *buf;
+	size_t len;
+	gcry_error_t err;
+	gcry_sexp_t account;
+
+	err = gcry_sexp_build(&account, NULL, "(account (name %s) (protocol %s) %S)",
+			account_name, protocol, privkey);
+	if (err != GPG_ERR_NO_ERROR) {
+		goto error;
+	}
+
+	len = gcry_sexp_sprint(account, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+	buf = malloc(len);
+	if (!buf) {
+		err = gcry_error_from_errno(ENOMEM);
+		goto error_buf;
+	}
+
+	gcry_sexp_sprint(account, GCRYSEXP_FMT_ADVANCED, buf, len);
+	fprintf(fp, " %s", buf);
+	free(buf);
+
+error_buf:
+	gcry_sexp_release(account);
+error:
+	return err;
+}
+
+/*
+ * Write the S-expression of a private key of a libotr state as in the key
+ * file, without the enclosing list.
+ */
+gcry_error_t key_write_privkey(FILE *fp, OtrlPrivKey *pk)
+{
+	assert(fp);
+	assert(pk);
+
+	return key_file_write_account(fp, pk->accountname, pk->protocol,
+			pk->privkey);
+}
+
+/*
+ * Write a private key file with the keys of a libotr state. If account_name
+ * is set, privkey is bound to it in place of the key it might have. The file
+ * is replaced once completely written.
+ */
+static gcry_error_t key_file_write(const char *filename, OtrlUserState us,
+		const char *account_name, gcry_sexp_t privkey)
+{
+	char *tmp_path;
+	FILE *fp;
+	OtrlPrivKey *pk;
+	gcry_error_t err = GPG_ERR_NO_ERROR;
+
+	fp = file_replace_open(filename, &tmp_path);
+	if (!fp) {
+		return gcry_error_from_errno(errno);
+	}
+
+	fputs("(privkeys\n", fp);
+	for (pk = us->privkey_root; pk && err == GPG_ERR_NO_ERROR; pk = pk->next) {
+		if (account_name && strcmp(pk->accountname, account_name) == 0 &&
+				strcmp(pk->protocol, OTR_PROTOCOL_ID) == 0) {
+			continue;
+		}
+		err = key_file_write_account(fp, pk->accountname, pk->protocol,
+				pk->privkey);
+	}
+	if (account_name && err == GPG_ERR_NO_ERROR) {
+		err = key_file_write_account(fp, account_name, OTR_PROTOCOL_ID,
+				privkey);
+	}
+	fputs(")\n", fp);
+
+	return file_replace_commit(fp, tmp_path, filename, err);
+}
+
+/*
+ * Take in the user state the keys written by other Irssi instances, new or
+ * replacing one. A state with a changed key reads the key file again. Called
+ * with the directory lock held.
+ */
+static void key_merge(struct otr_user_state *ustate)
+{
+	char *filename;
+	unsigned char ours[20], theirs[20];
+	gcry_error_t err = GPG_ERR_NO_ERROR;
+	GSList *reload = NULL, *tmp;
+	OtrlPrivKey *pk;
+	OtrlUserState scratch;
+	struct otr_user_state *shard;
+
+	if (ustate->root) {
+		ustate = ustate->root;
+	}
+
+	/* Lazy mode reads the key file when loading an account. */
+	if (ustate->dormant || !file_stamp_changed(KEY_FILE_KEYS)) {
+		goto error_filename;
+	}
+
+	filename = file_path_build(OTR_KEYFILE);
+	if (!filename) {
+		goto error_filename;
+	}
+
+	scratch = otrl_userstate_create();
+	if (access(filename, F_OK) == 0) {
+		err = otrl_privkey_read(scratch, filename);
+	}
+	if (err != GPG_ERR_NO_ERROR) {
+		IRSSI_DEBUG("Error reading private keys: %s", gcry_strerror(err));
+		goto end;
+	}
+
+	for (pk = scratch->privkey_root; pk; pk = pk->next) {
+		shard = otr_user_state_shard(ustate, pk->accountname);
+		if (!shard || g_slist_find(reload, shard) ||
+				!otrl_privkey_fingerprint_raw(scratch, theirs,
+					pk->accountname, pk->protocol)) {
+			continue;
+		}
+
+		if (!otrl_privkey_fingerprint_raw(shard->otr_state, ours,
+					pk->accountname, pk->protocol) ||
+				memcmp(ours, theirs, sizeof(ours)) != 0) {
+			reload = g_slist_prepend(reload, shard);
+		}
+	}
+
+	for (tmp = reload; tmp; tmp = tmp->next) {
+		shard = tmp->data;
+		otrl_privkey_read(shard->otr_state, filename);
+		if (shard->root) {
+			otr_user_state_prune(shard);
+		}
+	}
+
+	if (reload) {
+		IRSSI_DEBUG("Private keys of other instances merged");
+	}
+	g_slist_free(reload);
+
+	file_stamp_update(KEY_FILE_KEYS);
+
+end:
+	otrl_userstate_free(scratch);
+	free(filename);
+error_filename:
+	return;
+}
+
+/*
+ * Load the spare keys of the pool file if not done yet.
+ *
+ * Return 0 on success or else a negative value.
+ */
+static int key_pool_load(void)
+{
+	int ret = 0;
+	char *filename;
+	gcry_error_t err;
+
+	if (key_pool_state) {
+		goto end;
+	}
+
+	filename = file_path_build(OTR_KEYPOOL_FILE);
+	if (!filename) {
+		ret = -1;
+		goto end;
+	}
+
+	key_pool_state = otrl_userstate_create();
+
+	if (access(filename, F_OK) == 0) {
+		err = otrl_privkey_read(key_pool_state, filename);
+		if (err != GPG_ERR_NO_ERROR) {
+			IRSSI_DEBUG("Error loading key pool: %s", gcry_strerror(err));
+		}
+	}
+
+	free(filename);
+end:
+	return ret;
+}
+
+/*
+ * Bind a spare key of the pool to an account. The key leaves the pool file
+ * before being written in the key file so it is never used twice.
+ *
+ * Return 0 on success or else a negative value, the key has then to be
+ * generated.
+ */
+static int key_pool_take(struct otr_user_state *ustate,
+		const char *account_name)
+{
+	int ret = -1, lock = -1;
+	char *pool_path = NULL, *key_path = NULL;
+	gcry_error_t err;
+	gcry_sexp_t privkey = NULL;
+	OtrlPrivKey *spare;
+	OtrlUserState scratch;
+	struct otr_user_state *shard;
+
+	if (!key_pool_state) {
+		goto end;
+	}
+
+	shard = otr_user_state_shard(ustate, account_name);
+	pool_path = file_path_build(OTR_KEYPOOL_FILE);
+	key_path = file_path_build(OTR_KEYFILE);
+	if (!shard || !pool_path || !key_path) {
+		goto end;
+	}
+
+	lock = key_lock(LOCK_EX);
+
+	/* Other instances sharing the pool might have taken keys. */
+	if (access(pool_path, F_OK) == 0) {
+		otrl_privkey_read(key_pool_state, pool_path);
+	}
+
+	spare = key_pool_state->privkey_root;
+	if (!spare) {
+		goto end;
+	}
+
+	key_merge(ustate);
+
+	err = gcry_sexp_build(&privkey, NULL, "%S", spare->privkey);
+	if (err != GPG_ERR_NO_ERROR) {
+		goto end;
+	}
+
+	otrl_privkey_forget(spare);
+	err = key_file_write(pool_path, key_pool_state, NULL, NULL);
+	if (err != GPG_ERR_NO_ERROR) {
+		IRSSI_DEBUG("Error writing key pool: %s", gcry_strerror(err));
+		/* The key is still in the file, back to what it holds. */
+		otrl_privkey_read(key_pool_state, pool_path);
+		goto end;
+	}
+
+	/* The key file holds the keys of every account. */
+	scratch = otrl_userstate_create();
+	err = GPG_ERR_NO_ERROR;
+	if (access(key_path, F_OK) == 0) {
+		err = otrl_privkey_read(scratch, key_path);
+	}
+	if (err == GPG_ERR_NO_ERROR) {
+		err = key_file_write(key_path, scratch, account_name, privkey);
+	}
+	otrl_userstate_free(scratch);
+	if (err != GPG_ERR_NO_ERROR) {
+		IRSSI_DEBUG("Error binding spare key: %s", gcry_strerror(err));
+		goto end;
+	}
+
+	file_stamp_update(KEY_FILE_KEYS);
+
+	otrl_privkey_read(shard->otr_state, key_path);
+	if (shard->root) {
+		otr_user_state_prune(shard);
+	}
+
+	ret = 0;
+
+end:
+	key_unlock(lock);
+	gcry_sexp_release(privkey);
+	free(key_path);
+	free(pool_path);
+	return ret;
+}
+
+/*
+ * Queue the generation of a spare key if the pool is short and no account is
+ * waiting for a key. One spare key is generated at a time.
+ */
+static void key_pool_refill(void)
+{
+	int ret;
+	unsigned int count = 0;
+	char *name;
+	gcry_error_t err;
+	OtrlPrivKey *pk;
+	struct key_gen_data *job;
+
+	/* Only when idle. */
+	if (!key_pool_size || !key_pool_state || key_gen_jobs) {
+		goto end;
+	}
+
+	for (pk = key_pool_state->privkey_root; pk; pk = pk->next) {
+		count++;
+	}
+	if (count >= key_pool_size) {
+		goto end;
+	}
+
+	ret = asprintf(&name, "spare-%ld-%u", (long) time(NULL),
+			key_pool_serial++);
+	if (ret < 0) {
+		goto end;
+	}
+
+	job = zmalloc(sizeof(*job));
+	if (!job) {
+		free(name);
+		goto end;
+	}
+
+	job->account_name = name;
+	job->pool = 1;
+	job->status = KEY_GEN_QUEUED;
+	job->key_file_path = file_path_build(OTR_KEYPOOL_FILE);
+	if (!job->key_file_path) {
+		goto error;
+	}
+
+	err = otrl_privkey_generate_start(key_pool_state, name,
+			OTR_KEYPOOL_PROTOCOL, &job->newkey);
+	if (err != GPG_ERR_NO_ERROR || !job->newkey) {
+		IRSSI_DEBUG("Spare key generation start failed. Err: %s",
+				gcry_strerror(err));
+		goto error;
+	}
+
+	gcry_set_progress_handler(key_gen_progress, NULL);
+
+	key_gen_jobs = g_slist_append(key_gen_jobs, job);
+	key_gen_schedule();
+
+end:
+	return;
+
+error:
+	key_gen_free(job);
+	return;
+}
+
+/*
+ * Add a generated spare key to the pool file, readable by the user only.
+ */
+static gcry_error_t key_pool_finish(struct key_gen_data *job)
+{
+	int lock;
+	mode_t mask;
+	gcry_error_t err;
+
+	lock = key_lock(LOCK_EX);
+
+	/* Keep the spare keys added or taken by other instances. */
+	if (access(job->key_file_path, F_OK) == 0) {
+		otrl_privkey_read(key_pool_state, job->key_file_path);
+	}
+
+	mask = umask(077);
+	err = otrl_privkey_generate_finish(key_pool_state, job->newkey,
+			job->key_file_path);
+	umask(mask);
+
+	key_unlock(lock);
+
+	return err;
+}
+
+/*
+ * Finish the key generation of an account. Sharded, the key file holds the
+ * keys of every account but a shard only knows its own so the file is written
+ * from a scratch state loaded with it and read back in the shard. The keys
+ * written meanwhile by other instances are merged first, under the lock.
+ */
+static gcry_error_t key_gen_finish(struct otr_user_state *ustate,
+		const char *account_name, void *newkey, const char *filename)
+{
+	int ret, lock;
+	gcry_error_t err;
+	OtrlUserState scratch;
+	OtrlPendingPrivKey *pending;
+	struct otr_user_state *shard;
+
+	shard = otr_user_state_shard(ustate, account_name);
+	if (!shard) {
+		otrl_privkey_generate_cancelled(NULL, newkey);
+		return gcry_error_from_errno(ENOMEM);
+	}
+
+	lock = key_lock(LOCK_EX);
+
+	/* The file is written from the user state, with their keys then. */
+	key_merge(ustate);
+
+	if (!shard->root) {
+		err = otrl_privkey_generate_finish(shard->otr_state, newkey,
+				filename);
+		goto unlock;
+	}
+
+	scratch = otrl_userstate_create();
+
+	ret = access(filename, F_OK);
+	err = ret == 0 ? otrl_privkey_read(scratch, filename) : GPG_ERR_NO_ERROR;
+	if (err != GPG_ERR_NO_ERROR) {
+		/* Do not lose the keys of the other accounts. */
+		otrl_privkey_generate_cancelled(NULL, newkey);
+	} else {
+		err = otrl_privkey_generate_finish(scratch, newkey, filename);
+	}
+
+	/* The generation was started in the shard. */
+	for (pending = shard->otr_state->pending_root; pending;
+			pending = pending->next) {
+		if (strcmp(pending->accountname, account_name) == 0) {
+			otrl_privkey_pending_forget(pending);
+			break;
+		}
+	}
+
+	if (err != GPG_ERR_NO_ERROR) {
+		goto end;
+	}
+
+	err = otrl_privkey_read(shard->otr_state, filename);
+	otr_user_state_prune(shard);
+
+end:
+	otrl_userstate_free(scratch);
+unlock:
+	if (err == GPG_ERR_NO_ERROR) {
+		file_stamp_update(KEY_FILE_KEYS);
+	}
+	key_unlock(lock);
+	return err;
+}
+
+/*
+ * Check the key generation jobs, finish the completed ones and print message
+ * to user according to their state. Room left in the pool is then used by the
+ * queued jobs.
+ */
+void key_gen_check(void)
+{
+	GSList *tmp, *next;
+	gcry_error_t err;
+	enum key_gen_status status;
+	struct key_gen_data *job;
+
+	for (tmp = key_gen_jobs; tmp; tmp = next) {
+		next = tmp->next;
+		job = tmp->data;
+
+		pthread_mutex_lock(&key_gen_lock);
+		status = job->status;
+		pthread_mutex_unlock(&key_gen_lock);
+
+		if (status != KEY_GEN_FINISHED && status != KEY_GEN_ERROR) {
+			continue;
+		}
+
+		/* A job failing to start never had a thread. */
+		if (job->thread_started) {
+			pthread_join(job->thread, NULL);
+			job->thread_started = 0;
+			key_gen_running--;
+		}
+
+		if (job->cancelled) {
+			if (!job->pool) {
+				IRSSI_MSG("Key generation for %9%s%n cancelled",
+						job->account_name);
+			}
+			key_gen_discard(job);
+			continue;
+		}
+
+		if (job->pool) {
+			err = status == KEY_GEN_ERROR ? job->gcry_error :
+				key_pool_finish(job);
+			if (err != GPG_ERR_NO_ERROR) {
+				IRSSI_DEBUG("Spare key generation failed. Err: %s",
+						gcry_strerror(err));
+				/* Do not retry until the setting changes. */
+				key_pool_size = 0;
+			} else {
+				IRSSI_DEBUG("Spare key added to the pool");
+			}
+			if (status == KEY_GEN_ERROR) {
+				key_gen_discard(job);
+			} else {
+				key_gen_jobs = g_slist_remove(key_gen_jobs, job);
+				key_gen_free(job);
+			}
+			continue;
+		}
+
+		if (status == KEY_GEN_ERROR) {
+			IRSSI_MSG("Key generation for %9%s%n failed. Err: %s (%d)",
+					job->account_name, gcry_strerror(job->gcry_error),
+					job->gcry_error);
+			key_gen_discard(job);
+			continue;
+		}
+
+		err = key_gen_finish(job->ustate, job->account_name, job->newkey,
+				job->key_file_path);
+		if (err != GPG_ERR_NO_ERROR) {
+			IRSSI_MSG("Key generation finish state failed. Err: %s",
+					gcry_strerror(err));
+		} else {
+			IRSSI_MSG("Key generation for %9%s%n completed",
+					job->account_name);
+		}
+
+		key_gen_jobs = g_slist_remove(key_gen_jobs, job);
+		key_gen_free(job);
+	}
+
+	key_gen_schedule();
+	key_pool_refill();
+}
+
+/*
+ * Queue a key generation for an account. Up to the pool size, keys are
+ * generated at once in background threads (takes ages). The key file is only
+ * rewritten by key_gen_check() once a key is ready.
+ */
+void key_gen_run(struct otr_user_state *ustate, const char *account_name)
+{
+	gcry_error_t err;
+	struct otr_user_state *shard;
+	struct key_gen_data *job;
+
+	assert(ustate);
+	assert(account_name);
+
+	job = key_gen_find(account_name);
+	if (job) {
+		IRSSI_INFO(NULL, NULL, "Key generation for %s is still in progress. "
+				"Please wait until completion before creating a new key.",
+				job->account_name);
+		goto error_status;
+	}
+
+	if (key_pool_take(ustate, account_name) == 0) {
+		IRSSI_MSG("Key for %9%s%n taken from the key pool", account_name);
+		key_pool_refill();
+		return;
+	}
+
+	job = zmalloc(sizeof(*job));
+	if (!job) {
+		IRSSI_INFO(NULL, NULL, "Key generation failed. ENOMEM");
+		goto error_status;
+	}
+
+	/* Make sure the pointer does not go away during the proess. */
+	job->account_name = strdup(account_name);
+	job->ustate = ustate;
+	job->status = KEY_GEN_QUEUED;
+
+	/* Creating key file path. */
+	job->key_file_path = file_path_build(OTR_KEYFILE);
+	if (!job->account_name || !job->key_file_path) {
+		IRSSI_INFO(NULL, NULL, "Key generation failed. ENOMEM");
+		goto error;
+	}
+
+	shard = otr_user_state_shard(ustate, account_name);
+	if (!shard) {
+		IRSSI_INFO(NULL, NULL, "Key generation failed. ENOMEM");
+		goto error;
+	}
+
+	err = otrl_privkey_generate_start(shard->otr_state, account_name,
+			OTR_PROTOCOL_ID, &job->newkey);
+	if (err != GPG_ERR_NO_ERROR || !job->newkey) {
+		IRSSI_MSG("Key generation start failed. Err: %s", gcry_strerror(err));
+		goto error;
+	}
+
+	/* Idempotent, the handler only counts the steps of our threads. */
+	gcry_set_progress_handler(key_gen_progress, NULL);
+
+	key_gen_jobs = g_slist_append(key_gen_jobs, job);
+	if (key_gen_running >= key_gen_pool_size()) {
+		IRSSI_MSG("Key generation queued for %9%s%n", job->account_name);
+	}
+
+	key_gen_schedule();
+
+	return;
+
+error:
+	key_gen_free(job);
+error_status:
+	return;
+}
+
+/*
+ * Cancel the key generation of an account or of every account if NULL. A
+ * queued job is dropped right away. The calculation of a running one is
+ * abandoned at its next progress step and reaped by the next check.
+ */
+void key_gen_cancel(const char *account_name)
+{
+	GSList *tmp, *next;
+	struct key_gen_data *job;
+
+	for (tmp = key_gen_jobs; tmp; tmp = next) {
+		next = tmp->next;
+		job = tmp->data;
+
+		if (account_name && (job->pool ||
+					strcmp(job->account_name, account_name) != 0)) {
+			continue;
+		}
+
+		if (job->pool) {
+			key_gen_set_cancelled(job);
+			if (job->status == KEY_GEN_QUEUED) {
+				key_gen_discard(job);
+			}
+		} else if (job->status == KEY_GEN_QUEUED) {
+			IRSSI_MSG("Key generation for %9%s%n cancelled",
+					job->account_name);
+			key_gen_discard(job);
+		} else if (!job->cancelled) {
+			key_gen_set_cancelled(job);
+			IRSSI_MSG("Key generation for %9%s%n will be cancelled",
+					job->account_name);
+		}
+
+		if (account_name) {
+			goto end;
+		}
+	}
+
+	if (account_name) {
+		IRSSI_MSG("No key generation for %9%s%n", account_name);
+	}
+
+end:
+	return;
+}
+
+/*
+ * Print the state of every key generation job.
+ */
+void key_gen_print_status(void)
+{
+	GSList *tmp;
+	unsigned int progress;
+	enum key_gen_status status;
+	struct key_gen_data *job;
+
+	/* Reap what is done so only pending jobs are listed. */
+	key_gen_check();
+
+	if (!key_gen_jobs) {
+		IRSSI_MSG("No key generation in progress");
+		goto end;
+	}
+
+	for (tmp = key_gen_jobs; tmp; tmp = tmp->next) {
+		job = tmp->data;
+
+		pthread_mutex_lock(&key_gen_lock);
+		status = job->status;
+		progress = job->progress;
+		pthread_mutex_unlock(&key_gen_lock);
+
+		switch (status) {
+		case KEY_GEN_QUEUED:
+			IRSSI_MSG("%9%s%n: queued",
+					job->pool ? "key pool" : job->account_name);
+			break;
+		case KEY_GEN_RUNNING:
+			IRSSI_MSG("%9%s%n: running for %ds, %u steps%s",
+					job->pool ? "key pool" : job->account_name,
+					(int) (time(NULL) - job->start_time), progress,
+					job->cancelled ? " (cancelled)" : "");
+			break;
+		case KEY_GEN_FINISHED:
+		case KEY_GEN_ERROR:
+			IRSSI_MSG("%9%s%n: done",
+					job->pool ? "key pool" : job->account_name);
+			break;
+		}
+	}
+
+end:
+	return;
+}
+
+/*
+ * Cancel every job and wait for the running calculations since the threads run
+ * the module code. They stop at their next progress step so the wait is
+ * short. Called on unload by the thread running libotr while the main loop
+ * waits for it.
+ */
+void key_gen_deinit(void)
+{
+	GSList *tmp;
+	struct key_gen_data *job;
+
+	for (tmp = key_gen_jobs; tmp; tmp = tmp->next) {
+		key_gen_set_cancelled(tmp->data);
+	}
+
+	if (key_gen_running) {
+		IRSSI_MSG("Stopping %u running key generation(s)", key_gen_running);
+	}
+
+	for (tmp = key_gen_jobs; tmp; tmp = tmp->next) {
+		job = tmp->data;
+		if (job->thread_started) {
+			pthread_join(job->thread, NULL);
+		}
+	}
+
+	while (key_gen_jobs) {
+		key_gen_discard(key_gen_jobs->data);
+	}
+
+	key_gen_running = 0;
+	gcry_set_progress_handler(NULL, NULL);
+
+	if (key_pool_state) {
+		otrl_userstate_free(key_pool_state);
+		key_pool_state = NULL;
+	}
+}
+
+/*
+ * Write a file from the user state, or from each of its shards, with the
+ * given libotr FILE* writer. In lazy mode, the lines of the accounts not
+ * loaded follow. The file is replaced atomically.
+ */
+static gcry_error_t write_states(struct otr_user_state *ustate,
+		const char *filename, gcry_error_t (*write_fp)(OtrlUserState, FILE *),
+		enum otr_dormant_file file)
+{
+	char *tmp_path;
+	FILE *fp;
+	GList *states, *tmp;
+	gcry_error_t err = GPG_ERR_NO_ERROR;
+	struct otr_user_state *shard;
+
+	fp = file_replace_open(filename, &tmp_path);
+	if (!fp) {
+		return gcry_error_from_errno(errno);
+	}
+
+	states = otr_user_state_list(ustate);
+	for (tmp = states; tmp && err == GPG_ERR_NO_ERROR; tmp = tmp->next) {
+		shard = tmp->data;
+		err = write_fp(shard->otr_state, fp);
+	}
+	g_list_free(states);
+
+	if (err == GPG_ERR_NO_ERROR) {
+		err = otr_user_state_write_dormant(ustate, file, fp);
+	}
+
+	return file_replace_commit(fp, tmp_path, filename, err);
+}
+
+static void fp_record_free(gpointer data)
+{
+	struct key_fp_record *record = data;
+
+	g_free(record->trust);
+	free(record);
+}
+
+/*
+ * Return the otr.fp line of a fingerprint, without trust and newline.
+ */
+static char *fp_record_key(ConnContext *ctx, Fingerprint *fp)
+{
+	int i;
+	char hex[41];
+
+	for (i = 0; i < 20; i++) {
+		sprintf(hex + (i * 2), "%02x", fp->fingerprint[i]);
+	}
+
+	return g_strdup_printf("%s\t%s\t%s\t%s", ctx->username, ctx->accountname,
+			ctx->protocol, hex);
+}
+
+/*
+ * Bring the on disk view up to date with the user state. The changes are
+ * written to out as journal records if not NULL: "A" adds or sets the trust of
+ * a fingerprint and "D" forgets it.
+ */
+static void fp_view_update(struct otr_user_state *ustate, FILE *out)
+{
+	char *key;
+	const char *trust;
+	GList *states, *tmp;
+	GHashTableIter iter;
+	gpointer stored, value;
+	ConnContext *ctx;
+	Fingerprint *fp;
+	struct key_fp_record *record;
+	struct otr_user_state *shard;
+
+	key_fp_pass++;
+
+	states = otr_user_state_list(ustate);
+	for (tmp = states; tmp; tmp = tmp->next) {
+		shard = tmp->data;
+		for (ctx = shard->otr_state->context_root; ctx; ctx = ctx->next) {
+			/* Fingerprints are always attached to the master context. */
+			if (ctx != ctx->m_context) {
+				continue;
+			}
+
+			for (fp = ctx->fingerprint_root.next; fp; fp = fp->next) {
+				trust = fp->trust ? fp->trust : "";
+				key = fp_record_key(ctx, fp);
+
+				if (g_hash_table_lookup_extended(key_fp_view, key,
+							&stored, &value)) {
+					g_free(key);
+					key = stored;
+					record = value;
+				} else {
+					record = zmalloc(sizeof(*record));
+					if (!record) {
+						g_free(key);
+						continue;
+					}
+					g_hash_table_insert(key_fp_view, key, record);
+				}
+
+				record->pass = key_fp_pass;
+				if (record->trust && strcmp(record->trust, trust) == 0) {
+					continue;
+				}
+
+				g_free(record->trust);
+				record->trust = g_strdup(trust);
+				if (out) {
+					fprintf(out, "A\t%s\t%s\n", key, trust);
+				}
+			}
+		}
+	}
+	g_list_free(states);
+
+	g_hash_table_iter_init(&iter, key_fp_view);
+	while (g_hash_table_iter_next(&iter, &stored, &value)) {
+		record = value;
+		if (record->pass == key_fp_pass) {
+			continue;
+		}
+		if (out) {
+			fprintf(out, "D\t%s\n", (char *) stored);
+		}
+		g_hash_table_iter_remove(&iter);
+	}
+}
+
+/*
+ * Build the first record of a journal: the device and inode of the otr.fp it
+ * applies to, 0 if there is none. otr.fp being replaced by a rename, a journal
+ * left by a crash during a compaction does not match the new otr.fp anymore.
+ *
+ * Return a newly allocated record, without newline, or NULL on ENOMEM.
+ */
+static char *fp_journal_base(const char *fp_filename)
+{
+	struct stat st;
+
+	if (stat(fp_filename, &st) < 0) {
+		memset(&st, 0, sizeof(st));
+	}
+
+	return g_strdup_printf("S\t%llu\t%llu", (unsigned long long) st.st_dev,
+			(unsigned long long) st.st_ino);
+}
+
+/*
+ * Return 1 if line, the first record of a journal, is a base record not
+ * matching otr.fp, else 0. Journals without base record are replayed.
+ */
+static int fp_journal_stale(const char *line, const char *fp_filename)
+{
+	int stale;
+	char *base;
+
+	if (strncmp(line, "S\t", 2) != 0) {
+		return 0;
+	}
+
+	base = fp_journal_base(fp_filename);
+	stale = !base || strcmp(line, base) != 0;
+	g_free(base);
+
+	return stale;
+}
+
+/*
+ * Append the fingerprint changes to the journal and sync it. A new journal, or
+ * one left stale by a crash, starts over with the base record of otr.fp.
+ */
+static gcry_error_t fp_journal_append(struct otr_user_state *ustate,
+		const char *filename, const char *fp_filename)
+{
+	int ret, start = 0;
+	char *line = NULL, *base;
+	size_t size = 0;
+	ssize_t len;
+	mode_t mask;
+	FILE *fp;
+	gcry_error_t err = GPG_ERR_NO_ERROR;
+
+	fp = fopen(filename, "rb");
+	if (!fp) {
+		start = 1;
+	} else {
+		len = getline(&line, &size, fp);
+		if (len <= 0) {
+			start = 1;
+		} else {
+			if (line[len - 1] == '\n') {
+				line[len - 1] = '\0';
+			}
+			start = fp_journal_stale(line, fp_filename);
+		}
+		free(line);
+		fclose(fp);
+	}
+
+	mask = umask(077);
+	fp = fopen(filename, start ? "wb" : "ab");
+	umask(mask);
+	if (!fp) {
+		return gcry_error_from_errno(errno);
+	}
+
+	if (start) {
+		base = fp_journal_base(fp_filename);
+		if (base) {
+			fprintf(fp, "%s\n", base);
+			g_free(base);
+		}
+	}
+
+	fp_view_update(ustate, fp);
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+		err = gcry_error_from_errno(errno);
+	}
+	key_fp_journal_size = ftell(fp);
+
+	ret = fclose(fp);
+	if (ret != 0 && err == GPG_ERR_NO_ERROR) {
+		err = gcry_error_from_errno(errno);
+	}
+
+	return err;
+}
+
+/*
+ * Parse the 40 hex digits of a fingerprint.
+ *
+ * Return 0 on success or else a negative value.
+ */
+static int fp_parse_hex(const char *hex, unsigned char fingerprint[20])
+{
+	int i;
+	unsigned int byte;
+
+	if (strlen(hex) != 40) {
+		return -1;
+	}
+
+	for (i = 0; i < 20; i++) {
+		if (!g_ascii_isxdigit(hex[i * 2]) ||
+				!g_ascii_isxdigit(hex[(i * 2) + 1]) ||
+				sscanf(hex + (i * 2), "%2x", &byte) != 1) {
+			return -1;
+		}
+		fingerprint[i] = byte;
+	}
+
+	return 0;
+}
+
+/*
+ * Apply a journal record to a libotr state.
+ *
+ * Return 0 on success or else a negative value if the record is malformed.
+ */
+static int fp_journal_apply(OtrlUserState us, char *line)
+{
+	int ret = -1;
+	char **fields;
+	unsigned char fingerprint[20];
+	ConnContext *ctx;
+	Fingerprint *fp;
+
+	fields = g_strsplit(line, "\t", 6);
+
+	if (g_strv_length(fields) < 5 ||
+			fp_parse_hex(fields[4], fingerprint) < 0) {
+		goto end;
+	}
+
+	if (strcmp(fields[0], "A") == 0 && fields[5]) {
+		ctx = otrl_context_find(us, fields[1], fields[2], fields[3],
+				OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+		if (!ctx) {
+			goto end;
+		}
+		fp = otrl_context_find_fingerprint(ctx, fingerprint, 1, NULL);
+		otrl_context_set_trust(fp, fields[5][0] ? fields[5] : NULL);
+		ret = 0;
+	} else if (strcmp(fields[0], "D") == 0 && !fields[5]) {
+		ctx = otrl_context_find(us, fields[1], fields[2], fields[3],
+				OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+		fp = ctx ? otrl_context_find_fingerprint(ctx, fingerprint, 0, NULL) :
+			NULL;
+		if (fp) {
+			otrl_context_forget_fingerprint(fp, 1);
+		}
+		ret = 0;
+	}
+
+end:
+	g_strfreev(fields);
+	return ret;
+}
+
+/*
+ * Replay the fingerprint journal on top of what was read from otr.fp. A last
+ * record cut by a crash is ignored, as is a journal applying to an otr.fp
+ * replaced since.
+ *
+ * Return the number of records replayed.
+ */
+static int fp_journal_replay(OtrlUserState us, const char *filename,
+		const char *fp_filename)
+{
+	int count = 0, first = 1;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *fp;
+
+	fp = fopen(filename, "rb");
+	if (!fp) {
+		goto end;
+	}
+
+	while ((len = getline(&line, &size, fp)) > 0) {
+		if (line[len - 1] != '\n') {
+			break;
+		}
+		line[len - 1] = '\0';
+
+		if (first) {
+			first = 0;
+			if (fp_journal_stale(line, fp_filename)) {
+				IRSSI_DEBUG("Stale fingerprint journal ignored");
+				break;
+			}
+			if (strncmp(line, "S\t", 2) == 0) {
+				continue;
+			}
+		}
+
+		if (fp_journal_apply(us, line) < 0) {
+			IRSSI_DEBUG("Malformed fingerprint journal record ignored");
+			continue;
+		}
+		count++;
+	}
+
+	free(line);
+	fclose(fp);
+end:
+	return count;
+}
+
+/*
+ * Merge in the user state what other Irssi instances changed in otr.fp and its
+ * journal since this one last read or wrote them: new fingerprints, trust
+ * changes and forgotten fingerprints. A fingerprint changed on both sides takes
+ * the value on disk. The view then matches the disk again so the changes not
+ * written yet by this instance are still found against it. Called with the
+ * directory lock held.
+ */
+static void fp_merge(struct otr_user_state *ustate)
+{
+	int count = 0;
+	char *filename, *journal, **fields;
+	const char *trust;
+	unsigned char hash[20];
+	GHashTable *disk;
+	GHashTableIter iter;
+	gpointer key, value;
+	ConnContext *ctx;
+	Fingerprint *fp;
+	OtrlUserState scratch;
+	struct key_fp_record *record;
+
+	if (!key_fp_view || (!file_stamp_changed(KEY_FILE_FP) &&
+				!file_stamp_changed(KEY_FILE_FP_JOURNAL))) {
+		goto error_filename;
+	}
+
+	filename = file_path_build(OTR_FINGERPRINTS_FILE);
+	journal = file_path_build(OTR_FINGERPRINTS_JOURNAL);
+	if (!filename || !journal) {
+		goto end;
+	}
+
+	scratch = otrl_userstate_create();
+	if (access(filename, F_OK) == 0) {
+		otrl_privkey_read_fingerprints(scratch, filename, NULL, NULL);
+	}
+	fp_journal_replay(scratch, journal, filename);
+
+	/* Fingerprint to trust, as on disk. */
+	disk = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	for (ctx = scratch->context_root; ctx; ctx = ctx->next) {
+		if (ctx != ctx->m_context) {
+			continue;
+		}
+
+		for (fp = ctx->fingerprint_root.next; fp; fp = fp->next) {
+			trust = fp->trust ? fp->trust : "";
+			key = fp_record_key(ctx, fp);
+			record = g_hash_table_lookup(key_fp_view, key);
+			if (!record || strcmp(record->trust, trust) != 0) {
+				otr_fp_apply(ustate, ctx->username, ctx->accountname,
+						ctx->protocol, fp->fingerprint, trust);
+				count++;
+			}
+			g_hash_table_insert(disk, key, g_strdup(trust));
+		}
+	}
+
+	otrl_userstate_free(scratch);
+
+	/* Gone from the disk, forgotten by another instance. */
+	g_hash_table_iter_init(&iter, key_fp_view);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		if (g_hash_table_lookup(disk, key)) {
+			continue;
+		}
+
+		fields = g_strsplit(key, "\t", 4);
+		if (g_strv_length(fields) == 4 &&
+				fp_parse_hex(fields[3], hash) == 0) {
+			otr_fp_apply(ustate, fields[0], fields[1], fields[2], hash, NULL);
+			count++;
+		}
+		g_strfreev(fields);
+	}
+
+	g_hash_table_remove_all(key_fp_view);
+	g_hash_table_iter_init(&iter, disk);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		record = zmalloc(sizeof(*record));
+		if (!record) {
+			continue;
+		}
+		record->trust = value;
+		record->pass = key_fp_pass;
+		g_hash_table_iter_steal(&iter);
+		g_hash_table_insert(key_fp_view, key, record);
+	}
+	g_hash_table_destroy(disk);
+
+	file_stamp_update(KEY_FILE_FP);
+	file_stamp_update(KEY_FILE_FP_JOURNAL);
+	key_fp_journal_size = key_file_stamps[KEY_FILE_FP_JOURNAL].size;
+
+	if (count > 0) {
+		IRSSI_DEBUG("%d fingerprint changes of other instances merged", count);
+	}
+
+end:
+	free(journal);
+	free(filename);
+error_filename:
+	return;
+}
+
+/*
+ * Return the offset of a string in the snapshot string table, adding it if
+ * not there yet.
+ */
+static uint32_t fp_bin_string(GString *strtab, GHashTable *offsets,
+		const char *str)
+{
+	gpointer value;
+	uint32_t offset;
+
+	if (g_hash_table_lookup_extended(offsets, str, NULL, &value)) {
+		return GPOINTER_TO_UINT(value);
+	}
+
+	offset = strtab->len;
+	g_string_append_len(strtab, str, strlen(str) + 1);
+	g_hash_table_insert(offsets, (gpointer) str, GUINT_TO_POINTER(offset));
+
+	return offset;
+}
+
+/*
+ * Fill the otr.fp identity of a snapshot header with the current otr.fp.
+ *
+ * Return 0 on success or else a negative value if otr.fp is missing.
+ */
+static int fp_bin_stamp(struct key_fp_bin_header *header)
+{
+	struct key_file_stamp stamp;
+
+	file_stamp_get(KEY_FILE_FP, &stamp);
+	if (!stamp.exists) {
+		return -1;
 	}
 
-	/* Either NULL or the filename is returned here which is valid. */
-	ret = asprintf(&filename, "%s%s", get_client_config_dir(), path);
-	if (ret < 0) {
-		filename = NULL;
-	}
+	header->text_dev = stamp.dev;
+	header->text_ino = stamp.ino;
+	header->text_size = stamp.size;
+	header->text_mtime_sec = stamp.mtime.tv_sec;
+	header->text_mtime_nsec = stamp.mtime.tv_nsec;
 
-	return filename;
+	return 0;
 }
 
 /*
- * Reset key generation state and status is IDLE.
+ * Write the binary snapshot of the fingerprints of the user state. Records of
+ * a context are contiguous so the loader looks the context up once.
  */
-static void reset_key_gen_state(void)
+static gcry_error_t fp_bin_write(struct otr_user_state *ustate,
+		const char *filename)
 {
-	/* Safety. */
-	if (key_gen_state.key_file_path) {
-		free(key_gen_state.key_file_path);
+	char *tmp_path;
+	FILE *out;
+	GList *states, *tmp;
+	GString *strtab;
+	GArray *records;
+	GHashTable *offsets;
+	ConnContext *ctx;
+	Fingerprint *fp;
+	struct key_fp_bin_header header;
+	struct key_fp_bin_record record;
+	struct otr_user_state *shard;
+	gcry_error_t err = GPG_ERR_NO_ERROR;
+
+	strtab = g_string_new(NULL);
+	records = g_array_new(FALSE, FALSE, sizeof(record));
+	/* Keys are the strings of the user state, alive during the write. */
+	offsets = g_hash_table_new(g_str_hash, g_str_equal);
+
+	states = otr_user_state_list(ustate);
+	for (tmp = states; tmp; tmp = tmp->next) {
+		shard = tmp->data;
+		for (ctx = shard->otr_state->context_root; ctx; ctx = ctx->next) {
+			if (ctx != ctx->m_context) {
+				continue;
+			}
+
+			for (fp = ctx->fingerprint_root.next; fp; fp = fp->next) {
+				record.username = fp_bin_string(strtab, offsets,
+						ctx->username);
+				record.accountname = fp_bin_string(strtab, offsets,
+						ctx->accountname);
+				record.protocol = fp_bin_string(strtab, offsets,
+						ctx->protocol);
+				record.trust = fp->trust ?
+					fp_bin_string(strtab, offsets, fp->trust) :
+					KEY_FP_BIN_NO_TRUST;
+				memcpy(record.fingerprint, fp->fingerprint,
+						sizeof(record.fingerprint));
+				g_array_append_val(records, record);
+			}
+		}
+	}
+	g_list_free(states);
+
+	out = file_replace_open(filename, &tmp_path);
+	if (!out) {
+		err = gcry_error_from_errno(errno);
+		goto end;
 	}
 
-	/* Pointer dup when key_gen_run is called. */
-	if (key_gen_state.account_name) {
-		free(key_gen_state.account_name);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KEY_FP_BIN_MAGIC, sizeof(header.magic));
+	header.version = KEY_FP_BIN_VERSION;
+	header.byte_order = KEY_FP_BIN_BYTE_ORDER;
+	header.count = records->len;
+	header.strtab_size = strtab->len;
+
+	/* Written after otr.fp, which is there then. */
+	if (fp_bin_stamp(&header) < 0) {
+		err = gcry_error_from_errno(ENOENT);
+	} else if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+			(records->len && fwrite(records->data, sizeof(record),
+					records->len, out) != records->len) ||
+			(strtab->len && fwrite(strtab->str, strtab->len, 1, out) != 1)) {
+		err = gcry_error_from_errno(errno);
 	}
 
-	/* Nullify everything. */
-	memset(&key_gen_state, 0, sizeof(key_gen_state));
-	key_gen_state.status = KEY_GEN_IDLE;
-	key_gen_state.gcry_error = GPG_ERR_NO_ERROR;
+	err = file_replace_commit(out, tmp_path, filename, err);
+
+end:
+	g_hash_table_destroy(offsets);
+	g_array_free(records, TRUE);
+	g_string_free(strtab, TRUE);
+	return err;
 }
 
 /*
- * Generate OTR key. Thread in the background.
+ * Load the binary snapshot in a libotr state.
  *
- * NOTE: NO irssi interaction should be done here like emitting signals or else
- * it causes a segfaults of libperl.
+ * Return 0 on success or else a negative value if it is missing, not written
+ * after the current otr.fp or invalid. The state is then untouched and otr.fp
+ * is to be read.
  */
-static void *generate_key(void *data)
+static int fp_bin_load(OtrlUserState us, const char *text_path,
+		const char *filename)
 {
-	gcry_error_t err;
+	int ret = -1;
+	uint32_t i;
+	size_t len;
+	const char *data, *strtab;
+	struct key_fp_bin_header text;
+	const struct key_fp_bin_header *header;
+	const struct key_fp_bin_record *records, *record;
+	const struct key_fp_bin_record *prev = NULL;
+	GMappedFile *map;
+	ConnContext *ctx = NULL;
+	Fingerprint *fp;
 
-	assert(key_gen_state.newkey);
-
-	key_gen_state.status = KEY_GEN_RUNNING;
+	if (access(filename, F_OK) < 0) {
+		goto error;
+	}
 
-	err = otrl_privkey_generate_calculate(key_gen_state.newkey);
-	if (err != GPG_ERR_NO_ERROR) {
-		key_gen_state.status = KEY_GEN_ERROR;
-		key_gen_state.gcry_error = err;
+	map = g_mapped_file_new(filename, FALSE, NULL);
+	if (!map) {
 		goto error;
 	}
 
-	key_gen_state.status = KEY_GEN_FINISHED;
+	data = g_mapped_file_get_contents(map);
+	len = g_mapped_file_get_length(map);
+	header = (const struct key_fp_bin_header *) data;
+
+	/* Validate it all before touching the state. */
+	if (len < sizeof(*header) ||
+			memcmp(header->magic, KEY_FP_BIN_MAGIC, sizeof(header->magic)) ||
+			header->version != KEY_FP_BIN_VERSION ||
+			header->byte_order != KEY_FP_BIN_BYTE_ORDER ||
+			header->count > (len - sizeof(*header)) / sizeof(*record) ||
+			len != sizeof(*header) + (header->count * sizeof(*record)) +
+				header->strtab_size ||
+			(header->strtab_size && data[len - 1] != '\0')) {
+		goto invalid;
+	}
+
+	/*
+	 * otr.fp is the reference, it might have been edited, replaced or
+	 * removed, even within the same second.
+	 */
+	memset(&text, 0, sizeof(text));
+	if (fp_bin_stamp(&text) < 0 || text.text_dev != header->text_dev ||
+			text.text_ino != header->text_ino ||
+			text.text_size != header->text_size ||
+			text.text_mtime_sec != header->text_mtime_sec ||
+			text.text_mtime_nsec != header->text_mtime_nsec) {
+		IRSSI_DEBUG("Fingerprint snapshot not matching %9%s%9", text_path);
+		goto end;
+	}
+
+	records = (const struct key_fp_bin_record *) (data + sizeof(*header));
+	strtab = (const char *) (records + header->count);
+
+	for (i = 0; i < header->count; i++) {
+		record = &records[i];
+		if (record->username >= header->strtab_size ||
+				record->accountname >= header->strtab_size ||
+				record->protocol >= header->strtab_size ||
+				(record->trust != KEY_FP_BIN_NO_TRUST &&
+				 record->trust >= header->strtab_size)) {
+			goto invalid;
+		}
+	}
+
+	for (i = 0; i < header->count; i++) {
+		record = &records[i];
+
+		if (!prev || prev->username != record->username ||
+				prev->accountname != record->accountname ||
+				prev->protocol != record->protocol) {
+			ctx = otrl_context_find(us, strtab + record->username,
+					strtab + record->accountname, strtab + record->protocol,
+					OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+		}
+		prev = record;
+		if (!ctx) {
+			continue;
+		}
+
+		fp = otrl_context_find_fingerprint(ctx,
+				(unsigned char *) record->fingerprint, 1, NULL);
+		if (fp && record->trust != KEY_FP_BIN_NO_TRUST) {
+			otrl_context_set_trust(fp, strtab + record->trust);
+		}
+	}
+
+	ret = 0;
+	goto end;
 
+invalid:
+	IRSSI_DEBUG("Invalid fingerprint snapshot %9%s%9", filename);
+end:
+	g_mapped_file_unref(map);
 error:
-	return NULL;
+	return ret;
 }
 
 /*
- * Check key generation state and print message to user according to state.
+ * Write the binary snapshot after otr.fp. On error, it is removed so a stale
+ * one is never loaded. It is removed as well in lazy mode.
  */
-void key_gen_check(void)
+static void key_fp_snapshot(struct otr_user_state *ustate)
 {
+	char *filename;
 	gcry_error_t err;
 
-	switch (key_gen_state.status) {
-	case KEY_GEN_FINISHED:
-		err = otrl_privkey_generate_finish(key_gen_state.ustate->otr_state,
-				key_gen_state.newkey, key_gen_state.key_file_path);
-		if (err != GPG_ERR_NO_ERROR) {
-			IRSSI_MSG("Key generation finish state failed. Err: %s",
-					gcry_strerror(err));
-		} else {
-			IRSSI_MSG("Key generation for %9%s%n completed",
-					key_gen_state.account_name);
-		}
-		reset_key_gen_state();
-		break;
-	case KEY_GEN_ERROR:
-		IRSSI_MSG("Key generation for %9%s%n failed. Err: %s (%d)",
-				key_gen_state.account_name,
-				gcry_strerror(key_gen_state.gcry_error),
-				key_gen_state.gcry_error);
-		reset_key_gen_state();
-		break;
-	case KEY_GEN_RUNNING:
-	case KEY_GEN_IDLE:
-		/* Do nothing */
-		break;
-	};
+	filename = file_path_build(OTR_FINGERPRINTS_SNAPSHOT);
+	if (!filename) {
+		goto error_filename;
+	}
+
+	if (ustate->dormant) {
+		/* Only the loaded accounts would be in it. */
+		unlink(filename);
+		goto end;
+	}
+
+	err = fp_bin_write(ustate, filename);
+	if (err == GPG_ERR_NO_ERROR) {
+		IRSSI_DEBUG("Fingerprint snapshot saved to %9%s%9", filename);
+		key_fp_bin_stale = 0;
+	} else {
+		IRSSI_DEBUG("Error writing fingerprint snapshot: %s",
+				gcry_strerror(err));
+		unlink(filename);
+	}
+
+end:
+	free(filename);
+error_filename:
+	return;
 }
 
 /*
- * Run key generation in a seperate process (takes ages). The other process
- * will rewrite the key file, we shouldn't change anything till it's done and
- * we've reloaded the keys.
+ * Set up the fingerprint store once the user state is loaded. The binary
+ * snapshot is written if otr.fp had to be parsed and the on disk view starts
+ * from what was just loaded. Out of journal mode, a journal left from it,
+ * replayed at load, is folded into otr.fp.
  */
-void key_gen_run(struct otr_user_state *ustate, const char *account_name)
+void key_fp_store_start(struct otr_user_state *ustate)
 {
 	int ret;
-	gcry_error_t err;
+	char *filename;
+	struct stat st;
 
 	assert(ustate);
-	assert(account_name);
 
-	if (key_gen_state.status != KEY_GEN_IDLE) {
-		IRSSI_INFO(NULL, NULL, "Key generation for %s is still in progress. ",
-				"Please wait until completion before creating a new key.",
-				key_gen_state.account_name);
-		goto error_status;
+	filename = file_path_build(OTR_FINGERPRINTS_JOURNAL);
+	if (!filename) {
+		goto error_filename;
 	}
 
-	/* Make sure the pointer does not go away during the proess. */
-	key_gen_state.account_name = strdup(account_name);
-	key_gen_state.ustate = ustate;
+	/* Startup is faster next time. */
+	if (key_fp_bin_stale) {
+		key_fp_snapshot(ustate);
+	}
 
-	/* Creating key file path. */
-	key_gen_state.key_file_path = file_path_build(OTR_KEYFILE);
-	if (!key_gen_state.key_file_path) {
-		IRSSI_INFO(NULL, NULL, "Key generation failed. ENOMEM");
-		goto error;
+	/* Lazy mode only has the loaded accounts to build it from. */
+	if (!ustate->dormant) {
+		key_fp_view = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+				fp_record_free);
+		fp_view_update(ustate, NULL);
 	}
 
-	IRSSI_MSG("Key generation started for %9%s%n", key_gen_state.account_name);
+	ret = stat(filename, &st);
 
-	err = otrl_privkey_generate_start(ustate->otr_state, account_name,
-			OTR_PROTOCOL_ID, &key_gen_state.newkey);
-	if (err != GPG_ERR_NO_ERROR || !key_gen_state.newkey) {
-		IRSSI_MSG("Key generation start failed. Err: %s", gcry_strerror(err));
-		goto error;
+	if (!ustate->fp_journal) {
+		if (ret == 0) {
+			key_write_fingerprints(ustate);
+		}
+		goto end;
 	}
 
-	ret = pthread_create(&keygen_thread, NULL, generate_key, NULL);
-	if (ret < 0) {
-		IRSSI_MSG("Key generation failed. Thread failure: %s",
-				strerror(errno));
-		goto error;
+	key_fp_journal_size = ret == 0 ? st.st_size : 0;
+	if (key_fp_journal_size > KEY_FP_JOURNAL_MAX_SIZE) {
+		key_fp_compact = 1;
+		key_write_fingerprints(ustate);
 	}
 
+end:
+	free(filename);
+error_filename:
 	return;
+}
 
-error:
-	reset_key_gen_state();
-error_status:
-	return;
+static void key_write_flush_job(void *data)
+{
+	key_flush_fingerprints();
+	key_flush_instags();
+}
+
+/*
+ * End of the coalescing window. Called in the main loop.
+ */
+static gboolean key_write_timer_cb(gpointer data)
+{
+	key_write_timerid = 0;
+	otr_post_job(NULL, NULL, key_write_flush_job, NULL, NULL);
+
+	return FALSE;
+}
+
+static void key_write_timer_arm_cb(void *data)
+{
+	if (!key_write_timerid) {
+		key_write_timerid = g_timeout_add_seconds(KEY_WRITE_DELAY,
+				key_write_timer_cb, NULL);
+	}
 }
 
 /*
- * Write fingerprints to file.
+ * Mark the fingerprints to be written. Writes asked within KEY_WRITE_DELAY
+ * are coalesced in a single one, done by the thread running libotr.
  */
 void key_write_fingerprints(struct otr_user_state *ustate)
 {
+	assert(ustate);
+
+	if (!key_fp_dirty) {
+		worker_defer(key_write_timer_arm_cb, NULL, NULL);
+	}
+
+	/* A shard can be released before the write. */
+	key_fp_dirty = ustate->root ? ustate->root : ustate;
+}
+
+/*
+ * Write the fingerprints to file now if they changed. In journal mode, the
+ * changes are appended to the journal which is compacted into otr.fp once too
+ * large or if it could not be written.
+ */
+void key_flush_fingerprints(void)
+{
+	int lock;
 	gcry_error_t err;
-	char *filename;
+	char *filename, *journal;
+	struct otr_user_state *ustate = key_fp_dirty;
 
-	assert(ustate);
+	if (!ustate) {
+		goto error_filename;
+	}
+
+	key_fp_dirty = NULL;
 
 	filename = file_path_build(OTR_FINGERPRINTS_FILE);
-	if (!filename) {
-		goto error_filename;
+	journal = file_path_build(OTR_FINGERPRINTS_JOURNAL);
+	if (!filename || !journal) {
+		goto error_path;
+	}
+
+	/* Do not write over what other instances wrote meanwhile. */
+	lock = key_lock(LOCK_EX);
+	fp_merge(ustate);
+
+	if (ustate->fp_journal && !key_fp_compact) {
+		err = fp_journal_append(ustate, journal, filename);
+		file_stamp_update(KEY_FILE_FP_JOURNAL);
+		if (err != GPG_ERR_NO_ERROR) {
+			IRSSI_DEBUG("Error writing fingerprint journal: %s",
+					gcry_strerror(err));
+		} else if (key_fp_journal_size <= KEY_FP_JOURNAL_MAX_SIZE) {
+			IRSSI_DEBUG("Fingerprint changes journaled in %9%s%9", journal);
+			goto end;
+		}
 	}
 
-	err = otrl_privkey_write_fingerprints(ustate->otr_state, filename);
+	err = write_states(ustate, filename,
+			otrl_privkey_write_fingerprints_FILEp, OTR_DORMANT_FINGERPRINTS);
 	if (err == GPG_ERR_NO_ERROR) {
 		IRSSI_DEBUG("Fingerprints saved to %9%s%9", filename);
+
+		key_fp_snapshot(ustate);
+
+		/*
+		 * Everything is in otr.fp now. A crash before the unlink leaves a
+		 * journal whose base record no longer matches the new otr.fp.
+		 */
+		unlink(journal);
+		key_fp_journal_size = 0;
+		key_fp_compact = 0;
+		if (key_fp_view) {
+			fp_view_update(ustate, NULL);
+		}
+		file_stamp_update(KEY_FILE_FP);
+		file_stamp_update(KEY_FILE_FP_JOURNAL);
 	} else {
 		IRSSI_DEBUG("Error writing fingerprints: %d (%d)",
 				gcry_strerror(err), gcry_strsource(err));
+		/* The journal might not match the view anymore. */
+		key_fp_compact = 1;
 	}
 
+end:
+	key_unlock(lock);
+error_path:
+	free(journal);
 	free(filename);
 error_filename:
 	return;
 }
 
 /*
- * Write instance tags to file.
+ * Mark the instance tags to be written along with the fingerprints, so
+ * bringing up many accounts rewrites otr.instag once.
  */
 void key_write_instags(struct otr_user_state *ustate)
 {
+	assert(ustate);
+
+	if (!key_instag_dirty) {
+		worker_defer(key_write_timer_arm_cb, NULL, NULL);
+	}
+
+	key_instag_dirty = ustate->root ? ustate->root : ustate;
+}
+
+/*
+ * Take in the user state the instance tags other Irssi instances gave to the
+ * accounts without one here. Called with the directory lock held.
+ */
+static void instag_merge(struct otr_user_state *ustate)
+{
+	char *filename, *line;
+	FILE *fp;
+	OtrlInsTag *instag;
+	OtrlUserState scratch;
+	struct otr_user_state *shard;
+
+	if (ustate->root) {
+		ustate = ustate->root;
+	}
+
+	if (ustate->dormant || !file_stamp_changed(KEY_FILE_INSTAGS)) {
+		goto error_filename;
+	}
+
+	filename = file_path_build(OTR_INSTAG_FILE);
+	if (!filename) {
+		goto error_filename;
+	}
+
+	scratch = otrl_userstate_create();
+	if (access(filename, F_OK) == 0) {
+		otrl_instag_read(scratch, filename);
+	}
+
+	for (instag = scratch->instag_root; instag; instag = instag->next) {
+		shard = otr_user_state_shard(ustate, instag->accountname);
+		if (!shard || otrl_instag_find(shard->otr_state, instag->accountname,
+					instag->protocol)) {
+			continue;
+		}
+
+		/* libotr only adds instance tags by reading them. */
+		line = g_strdup_printf("%s\t%s\t%08x\n", instag->accountname,
+				instag->protocol, instag->instag);
+		fp = fmemopen(line, strlen(line), "r");
+		if (fp) {
+			otrl_instag_read_FILEp(shard->otr_state, fp);
+			fclose(fp);
+		}
+		g_free(line);
+	}
+
+	otrl_userstate_free(scratch);
+	file_stamp_update(KEY_FILE_INSTAGS);
+
+	free(filename);
+error_filename:
+	return;
+}
+
+/*
+ * Write the instance tags to file now if they changed.
+ */
+void key_flush_instags(void)
+{
+	int lock;
 	gcry_error_t err;
 	char *filename;
+	struct otr_user_state *ustate = key_instag_dirty;
 
-	assert(ustate);
+	if (!ustate) {
+		goto error_filename;
+	}
+
+	key_instag_dirty = NULL;
 
 	filename = file_path_build(OTR_INSTAG_FILE);
 	if (!filename) {
 		goto error_filename;
 	}
 
-	err = otrl_instag_write(ustate->otr_state, filename);
+	lock = key_lock(LOCK_EX);
+	instag_merge(ustate);
+
+	err = write_states(ustate, filename, otrl_instag_write_FILEp,
+			OTR_DORMANT_INSTAGS);
 	if (err == GPG_ERR_NO_ERROR) {
 		IRSSI_DEBUG("Instance tags saved in %9%s%9", filename);
+		file_stamp_update(KEY_FILE_INSTAGS);
 	} else {
 		IRSSI_DEBUG("Error saving instance tags: %d (%d)",
 				gcry_strerror(err), gcry_strsource(err));
 	}
 
+	key_unlock(lock);
 	free(filename);
 error_filename:
 	return;
 }
 
+/*
+ * Give an account an instance tag if it has none. The file is written later
+ * by key_write_instags().
+ */
+void key_gen_instag(struct otr_user_state *ustate, const char *accname,
+		const char *protocol)
+{
+	struct otr_user_state *shard;
+
+	assert(ustate);
+	assert(accname);
+	assert(protocol);
+
+	shard = otr_user_state_shard(ustate, accname);
+	if (!shard) {
+		return;
+	}
+
+	if (otrl_instag_find(shard->otr_state, accname, protocol)) {
+		return;
+	}
+
+	/* Nothing is written, the file holds every shard. */
+	otrl_instag_generate(shard->otr_state, "/dev/null", accname, protocol);
+	key_write_instags(shard);
+}
+
 /*
  * Load private keys.
  */
@@ -292,6 +2386,47 @@ error_filename:
 	return;
 }
 
+/*
+ * Load the private keys of an account in lazy mode from the S-expressions
+ * kept when the files were loaded. otr.key is read again instead if another
+ * Irssi instance changed it since.
+ */
+void key_load_account(struct otr_user_state *shard, const GString *keys)
+{
+	char *text;
+	FILE *fp;
+	gcry_error_t err;
+
+	assert(shard);
+
+	if (file_stamp_changed(KEY_FILE_KEYS)) {
+		key_load(shard);
+		goto end;
+	}
+
+	if (!keys || keys->len == 0) {
+		goto end;
+	}
+
+	text = g_strdup_printf("(privkeys\n%s)\n", keys->str);
+	fp = fmemopen(text, strlen(text), "r");
+	if (!fp) {
+		err = gcry_error_from_errno(errno);
+	} else {
+		err = otrl_privkey_read_FILEp(shard->otr_state, fp);
+		fclose(fp);
+	}
+	g_free(text);
+
+	if (err != GPG_ERR_NO_ERROR) {
+		IRSSI_DEBUG("Error loading private keys of %9%s%9: %s",
+				shard->accname, gcry_strerror(err));
+	}
+
+end:
+	return;
+}
+
 /*
  * Load fingerprints.
  */
@@ -299,7 +2434,7 @@ void key_load_fingerprints(struct otr_user_state *ustate)
 {
 	int ret;
 	gcry_error_t err;
-	char *filename;
+	char *filename, *snapshot, *journal;
 
 	assert(ustate);
 
@@ -314,17 +2449,124 @@ void key_load_fingerprints(struct otr_user_state *ustate)
 		goto end;
 	}
 
+	snapshot = file_path_build(OTR_FINGERPRINTS_SNAPSHOT);
+	if (snapshot) {
+		ret = fp_bin_load(ustate->otr_state, filename, snapshot);
+		free(snapshot);
+		if (ret == 0) {
+			IRSSI_DEBUG("Fingerprints loaded from snapshot");
+			goto end;
+		}
+	}
+
 	err = otrl_privkey_read_fingerprints(ustate->otr_state, filename, NULL,
 			NULL);
 	if (err == GPG_ERR_NO_ERROR) {
 		IRSSI_DEBUG("Fingerprints loaded from %9%s%9", filename);
+		key_fp_bin_stale = 1;
 	} else {
 		IRSSI_DEBUG("Error loading fingerprints: %d (%d)",
 				gcry_strerror(err), gcry_strsource(err));
 	}
 
 end:
+	/* Changes not yet compacted in otr.fp, whatever the mode. */
+	journal = file_path_build(OTR_FINGERPRINTS_JOURNAL);
+	if (journal) {
+		ret = fp_journal_replay(ustate->otr_state, journal, filename);
+		if (ret > 0) {
+			IRSSI_DEBUG("%d fingerprint journal records replayed", ret);
+		}
+		free(journal);
+	}
 	free(filename);
 error_filename:
 	return;
 }
+
+/*
+ * Remember the shared files as just loaded, their later changes being made by
+ * other Irssi instances. Called with the directory lock held.
+ */
+void key_merge_start(void)
+{
+	int i;
+
+	for (i = 0; i < KEY_FILE_COUNT; i++) {
+		file_stamp_update(i);
+	}
+}
+
+/*
+ * Merge the changes other Irssi instances made to the shared files, if any.
+ * Not done in lazy mode, where otr.key is read when loading an account and
+ * the fingerprints of the others are written back as they are.
+ */
+void key_merge_files(struct otr_user_state *ustate)
+{
+	int lock;
+
+	assert(ustate);
+
+	lock = key_lock(LOCK_SH);
+	key_merge(ustate);
+	instag_merge(ustate);
+	fp_merge(ustate);
+	key_unlock(lock);
+}
+
+/*
+ * Return 1 if name is the name of a file shared with other Irssi instances
+ * and merged by key_merge_files().
+ */
+int key_file_shared(const char *name)
+{
+	int i;
+	const char *base;
+
+	assert(name);
+
+	for (i = 0; i < KEY_FILE_COUNT; i++) {
+		base = strrchr(key_file_paths[i], '/');
+		if (base && strcmp(base + 1, name) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Set the number of spare keys of the pool and refill it. The pool file is
+ * only read once the pool is enabled.
+ */
+void key_pool_resize(unsigned int size)
+{
+	key_pool_size = size;
+
+	if (size && key_pool_load() < 0) {
+		return;
+	}
+
+	key_pool_refill();
+}
+
+/*
+ * Write what is pending and remove the write timer. Called on unload once the
+ * worker is stopped.
+ */
+void key_write_deinit(void)
+{
+	if (key_write_timerid) {
+		g_source_remove(key_write_timerid);
+		key_write_timerid = 0;
+	}
+
+	key_flush_fingerprints();
+	key_flush_instags();
+
+	if (key_fp_view) {
+		g_hash_table_destroy(key_fp_view);
+		key_fp_view = NULL;
+	}
+}
@@ -21,20 +21,40 @@
 #ifndef IRSSI_OTR_KEY_H
 #define IRSSI_OTR_KEY_H
 
+#include <pthread.h>
+#include <setjmp.h>
+#include <time.h>
+
 #include "otr.h"
 
+/*
+ * Number of spare private keys generated in the background and bound to new
+ * accounts. 0 disables the pool.
+ */
+#define OTR_SET_KEY_POOL_SIZE         "otr_key_pool_size"
+
+/*
+ * Append the fingerprint changes to a journal next to otr.fp instead of
+ * rewriting it. Read when the module loads.
+ */
+#define OTR_SET_FP_JOURNAL            "otr_fp_journal"
+
+/* Protocol of the spare keys in the pool file. */
+#define OTR_KEYPOOL_PROTOCOL          "keypool"
+
 /*
  * Status of key generation.
  */
 enum key_gen_status {
-	KEY_GEN_IDLE		= 0,
+	KEY_GEN_QUEUED		= 0,
 	KEY_GEN_RUNNING		= 1,
 	KEY_GEN_FINISHED    = 2,
 	KEY_GEN_ERROR		= 3,
 };
 
 /*
- * Data of the state of key generation.
+ * Key generation job of an account. The status and progress are updated by
+ * the generation thread under the key generation lock.
  */
 struct key_gen_data {
 	struct otr_user_state *ustate;
@@ -43,13 +63,43 @@ struct key_gen_data {
 	enum key_gen_status status;
 	gcry_error_t gcry_error;
 	void *newkey;
+	pthread_t thread;
+	int thread_started;
+	time_t start_time;
+	/* Steps reported by libgcrypt during the calculation. */
+	unsigned int progress;
+	/*
+	 * Set under the key generation lock, the calculation is then abandoned
+	 * from the progress handler through abort.
+	 */
+	int cancelled;
+	jmp_buf abort;
+	/* Spare key for the pool, account_name is a placeholder. */
+	int pool;
 };
 
 void key_gen_check(void);
 void key_gen_run(struct otr_user_state *ustate, const char *account_name);
+void key_gen_cancel(const char *account_name);
+void key_gen_print_status(void);
+void key_gen_deinit(void);
+void key_pool_resize(unsigned int size);
 void key_load(struct otr_user_state *ustate);
+void key_load_account(struct otr_user_state *shard, const GString *keys);
+gcry_error_t key_write_privkey(FILE *fp, OtrlPrivKey *pk);
 void key_load_fingerprints(struct otr_user_state *ustate);
 void key_write_fingerprints(struct otr_user_state *ustate);
+void key_flush_fingerprints(void);
+void key_fp_store_start(struct otr_user_state *ustate);
+void key_write_deinit(void);
 void key_write_instags(struct otr_user_state *ustate);
+void key_flush_instags(void);
+void key_gen_instag(struct otr_user_state *ustate, const char *accname,
+		const char *protocol);
+int key_lock(int operation);
+void key_unlock(int fd);
+void key_merge_start(void);
+void key_merge_files(struct otr_user_state *ustate);
+int key_file_shared(const char *name);
 
 #endif /* IRSSI_OTR_KEY_H */
@@ -33,6 +33,7 @@
 #include "otr.h"
 #include "otr-formats.h"
 #include "utils.h"
+#include "watch.h"
 
 # if GCRYPT_VERSION_NUMBER < 0x010600 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
@@ -56,79 +57,289 @@ void perl_signal_register(const char *signal, const char **args);
 struct otr_user_state *user_state_global;
 
 /*
- * Pipes all outgoing private messages through OTR
+ * 1 once gcrypt, libotr, the user state and the worker are set up, -1 if that
+ * failed. Main loop only.
  */
-static void sig_server_sendmsg(SERVER_REC *server, const char *target,
-		const char *msg, void *target_type_p)
+static int otr_started;
+
+static int otr_start(void);
+
+/*
+ * Return 1 if a message is OTR traffic: query, encoded or error message, or
+ * plaintext carrying the whitespace tag.
+ */
+static int otr_message_tagged(const char *msg)
 {
-	int ret;
-	char *otrmsg = NULL;
+	return msg && (strstr(msg, "?OTR") || strstr(msg, OTRL_MESSAGE_TAG_BASE));
+}
 
-	key_gen_check();
+/*
+ * Return 1 if a message sent to target must go through OTR even if not
+ * started yet: it is OTR traffic or the policy of the conversation tags or
+ * encrypts outgoing messages (opportunistic, always).
+ */
+static int otr_message_wanted(SERVER_REC *server, const char *target,
+		const char *msg)
+{
+	return otr_message_tagged(msg) || (otr_policy(server, target) &
+			(OTRL_POLICY_SEND_WHITESPACE_TAG | OTRL_POLICY_REQUIRE_ENCRYPTION));
+}
 
-	if (GPOINTER_TO_INT(target_type_p) != SEND_TARGET_NICK) {
-		goto end;
+/*
+ * Message of a peer handed to the worker. The server record is kept alive by
+ * the job.
+ */
+struct msg_job {
+	SERVER_REC *irssi;
+	char *target;
+	char *msg;
+	/* Address of the sender of a received message. */
+	char *address;
+	/* Set by the worker if a /me was encrypted. */
+	int encrypted;
+};
+
+/*
+ * Incoming message decoded by the worker, waiting to be delivered.
+ */
+struct msg_delivery {
+	SERVER_REC *irssi;
+	char *msg;
+	char *nick;
+	char *address;
+	/* The message is an IRC action (/me). */
+	int action;
+};
+
+/* Set while a message handled by the worker is delivered to Irssi. */
+static int delivering;
+/* Set while a plaintext /me is handed back to Irssi. */
+static int me_bypass;
+
+static void msg_job_free(void *data)
+{
+	struct msg_job *job = data;
+
+	free(job->target);
+	free(job->msg);
+	free(job->address);
+	free(job);
+}
+
+/*
+ * Post a message job to the worker.
+ */
+static void post_msg_job(SERVER_REC *server, const char *target,
+		const char *msg, const char *address, worker_func_t func)
+{
+	struct msg_job *job;
+
+	job = zmalloc(sizeof(*job));
+	if (!job) {
+		goto error;
+	}
+
+	job->irssi = server;
+	job->target = strdup(target);
+	job->msg = msg ? strdup(msg) : NULL;
+	job->address = address ? strdup(address) : NULL;
+	if (!job->target || (msg && !job->msg) || (address && !job->address)) {
+		msg_job_free(job);
+		goto error;
 	}
 
+	otr_post_job(server, target, func, job, msg_job_free);
+
+error:
+	return;
+}
+
+static void msg_delivery_free(void *data)
+{
+	struct msg_delivery *delivery = data;
+
+	free(delivery->msg);
+	free(delivery->nick);
+	free(delivery->address);
+	free(delivery);
+}
+
+static void msg_delivery_cb(void *data)
+{
+	const char *address;
+	struct msg_delivery *delivery = data;
+
+	if (delivery->irssi->disconnected) {
+		return;
+	}
+
+	address = delivery->address;
+	if (!address) {
+		address = IRSSI_CONN_ADDR(delivery->irssi);
+	}
+
+	/*
+	 * Let irssi handle /me as an IRC action so the user does not receive a
+	 * message beginning with /me.
+	 */
+	if (delivery->action) {
+		signal_emit("message irc action", 5, delivery->irssi, delivery->msg,
+				delivery->nick, address, delivery->nick);
+		return;
+	}
+
+	/* Our handler lets this one through. */
+	delivering = 1;
+	signal_emit("message private", 4, delivery->irssi, delivery->msg,
+			delivery->nick, address);
+	delivering = 0;
+}
+
+/*
+ * Deliver a private message to Irssi from the main loop. The address defaults
+ * to the one of the server if NULL.
+ */
+void irssi_deliver_message(SERVER_REC *irssi, const char *msg,
+		const char *nick, const char *address, int action)
+{
+	struct msg_delivery *delivery;
+
+	delivery = zmalloc(sizeof(*delivery));
+	if (!delivery) {
+		goto error;
+	}
+
+	delivery->irssi = irssi;
+	delivery->msg = strdup(msg);
+	delivery->nick = strdup(nick);
+	delivery->address = address ? strdup(address) : NULL;
+	delivery->action = action;
+	if (!delivery->msg || !delivery->nick ||
+			(address && !delivery->address)) {
+		msg_delivery_free(delivery);
+		goto error;
+	}
+
+	worker_defer(msg_delivery_cb, delivery, msg_delivery_free);
+
+error:
+	return;
+}
+
+/*
+ * Worker side of an outgoing private message.
+ */
+static void send_job(void *data)
+{
+	int ret;
+	char *otrmsg = NULL;
+	struct msg_job *job = data;
+
 	/* Critical section. On error, message MUST NOT be sent */
-	ret = otr_send(server, msg, target, &otrmsg);
+	ret = otr_send(job->irssi, job->msg, job->target, &otrmsg);
 	if (ret) {
-		signal_stop();
 		goto end;
 	}
 
-	if (!otrmsg) {
-		/* Send original message */
-		signal_continue(4, server, target, msg, target_type_p);
+	/*
+	 * Queued after the fragments injected by libotr, if any. Plaintext skips
+	 * the OTR pacing.
+	 */
+	if (otrmsg) {
+		otr_queue_message(job->irssi, job->target, otrmsg, OTR_SCHED_BULK);
 	} else {
-		/* Send encrypted message */
-		signal_continue(4, server, target, otrmsg, target_type_p);
+		otr_send_plaintext(job->irssi, job->target, job->msg);
 	}
 
 end:
 	otrl_message_free(otrmsg);
+}
+
+/*
+ * Pipes all outgoing private messages through OTR
+ */
+static void sig_server_sendmsg(SERVER_REC *server, const char *target,
+		const char *msg, void *target_type_p)
+{
+	if (GPOINTER_TO_INT(target_type_p) != SEND_TARGET_NICK) {
+		goto end;
+	}
+
+	/* Plaintext until OTR is used. */
+	if (otr_started <= 0 && (!otr_message_wanted(server, target, msg) ||
+				otr_start() < 0)) {
+		goto end;
+	}
+
+	/* Already processed by OTR and sent back through the scheduler. */
+	if (sched_in_send()) {
+		goto end;
+	}
+
+	/* The worker sends it once handled by OTR. */
+	signal_stop();
+	post_msg_job(server, target, msg, NULL, send_job);
+
+end:
 	return;
 }
 
 /*
- * Pipes all incoming private messages through OTR
+ * Worker side of an incoming private message.
  */
-void sig_message_private(SERVER_REC *server, const char *msg,
-		const char *nick, const char *address)
+static void receive_job(void *data)
 {
 	int ret;
 	char *new_msg = NULL;
+	struct msg_job *job = data;
 
-	key_gen_check();
-
-	ret = otr_receive(server, msg, nick, &new_msg);
+	ret = otr_receive(job->irssi, job->msg, job->target, &new_msg);
 	if (ret) {
-		signal_stop();
 		goto end;
 	}
 
 	if (!new_msg) {
 		/* This message was not OTR */
-		signal_continue(4, server, msg, nick, address);
+		irssi_deliver_message(job->irssi, job->msg, job->target,
+				job->address, 0);
+	} else if (!strncmp(new_msg, OTR_IRC_MARKER_ME, OTR_IRC_MARKER_ME_LEN)) {
+		irssi_deliver_message(job->irssi, new_msg + OTR_IRC_MARKER_ME_LEN,
+				job->target, job->address, 1);
 	} else {
-		/*
-		 * Check for /me IRC marker and if so, handle it so the user does not
-		 * receive a message beginning with /me but rather let irssi handle it
-		 * as a IRC action.
-		 */
-		if (!strncmp(new_msg, OTR_IRC_MARKER_ME, OTR_IRC_MARKER_ME_LEN)) {
-			signal_stop();
-			signal_emit("message irc action", 5, server,
-					new_msg + OTR_IRC_MARKER_ME_LEN, nick, address, nick);
-		} else {
-			/* OTR received message */
-			signal_continue(4, server, new_msg, nick, address);
-		}
+		/* OTR received message */
+		irssi_deliver_message(job->irssi, new_msg, job->target,
+				job->address, 0);
 	}
 
 end:
 	otrl_message_free(new_msg);
-	return;
+}
+
+/*
+ * Pipes all incoming private messages through OTR
+ */
+static void sig_message_private(SERVER_REC *server, const char *msg,
+		const char *nick, const char *address)
+{
+	/* Handled by the worker already. */
+	if (delivering) {
+		return;
+	}
+
+	if (otr_started <= 0 && (!otr_message_tagged(msg) || otr_start() < 0)) {
+		return;
+	}
+
+	/* Delivered back by the worker, in order. */
+	signal_stop();
+	post_msg_job(server, nick, msg, address, receive_job);
+}
+
+static void finish_job(void *data)
+{
+	struct msg_job *job = data;
+
+	otr_finish(job->irssi, job->target);
 }
 
 /*
@@ -136,68 +347,176 @@ end:
  */
 static void sig_query_destroyed(QUERY_REC *query)
 {
-	if (query && query->server && query->server->connrec) {
-		otr_finish(query->server, query->name);
+	if (otr_started > 0 && query && query->server &&
+			query->server->connrec) {
+		post_msg_job(query->server, query->name, NULL, NULL, finish_job);
 	}
 }
 
 /*
- * Handle /me IRC command.
+ * Cache the account name of a server once it is connected.
  */
-static void cmd_me(const char *data, IRC_SERVER_REC *server,
-		WI_ITEM_REC *item)
+static void sig_server_connected(SERVER_REC *server)
 {
-	int ret;
-	const char *target;
-	char *msg, *otrmsg = NULL;
-	QUERY_REC *query;
+	if (otr_started > 0) {
+		otr_server_update(server);
+	}
+}
 
-	query = QUERY(item);
+/*
+ * Our nick changed so the account name of the server did too.
+ */
+static void sig_server_nick_changed(SERVER_REC *server)
+{
+	if (otr_started > 0) {
+		otr_server_update(server);
+	}
+}
+
+/*
+ * Release the module data of a disconnected server.
+ */
+static void sig_server_disconnected(SERVER_REC *server)
+{
+	otr_server_free(server);
+}
 
-	key_gen_check();
+/*
+ * Hand a /me back to Irssi once handled by the worker. An encrypted one is
+ * only displayed, a plaintext one is run again by Irssi.
+ */
+static void me_delivery_cb(void *data)
+{
+	QUERY_REC *query;
+	struct msg_job *job = data;
 
-	if (!query || !query->server) {
-		goto end;
+	if (job->irssi->disconnected) {
+		return;
 	}
 
-	CMD_IRC_SERVER(server);
-	if (!IS_IRC_QUERY(query)) {
-		goto end;
+	query = query_find(job->irssi, job->target);
+
+	if (job->encrypted) {
+		signal_emit("message irc own_action", 3, job->irssi, job->msg,
+				query ? query->visible_name : job->target);
+		return;
 	}
 
-	if (!server || !server->connected) {
-		cmd_return_error(CMDERR_NOT_CONNECTED);
+	if (!query) {
+		return;
 	}
 
-	target = window_item_get_target(item);
+	me_bypass = 1;
+	signal_emit("command me", 3, job->msg, job->irssi, query);
+	me_bypass = 0;
+}
 
-	ret = asprintf(&msg, OTR_IRC_MARKER_ME "%s", data);
+/*
+ * Worker side of /me. The job data outlives the deferred call.
+ */
+static void me_job(void *data)
+{
+	int ret;
+	char *msg, *otrmsg = NULL;
+	struct msg_job *job = data;
+
+	ret = asprintf(&msg, OTR_IRC_MARKER_ME "%s", job->msg);
 	if (ret < 0) {
 		goto end;
 	}
 
 	/* Critical section. On error, message MUST NOT be sent */
-	ret = otr_send(query->server, msg, target, &otrmsg);
+	ret = otr_send(job->irssi, msg, job->target, &otrmsg);
 	free(msg);
-
-	if (!otrmsg) {
+	if (ret) {
 		goto end;
 	}
 
-	signal_stop();
-
 	if (otrmsg) {
 		/* Send encrypted message */
-		irssi_send_message(SERVER(server), target, otrmsg);
+		otr_queue_message(job->irssi, job->target, otrmsg, OTR_SCHED_BULK);
 		otrl_message_free(otrmsg);
+		job->encrypted = 1;
 	}
 
-	signal_emit("message irc own_action", 3, server, data, item->visible_name);
+	worker_defer(me_delivery_cb, job, NULL);
 
 end:
 	return;
 }
 
+/*
+ * Handle /me IRC command.
+ */
+static void cmd_me(const char *data, IRC_SERVER_REC *server,
+		WI_ITEM_REC *item)
+{
+	QUERY_REC *query;
+
+	/* Plaintext /me handed back by the worker, or OTR not used yet. */
+	if (me_bypass || otr_started <= 0) {
+		goto end;
+	}
+
+	query = QUERY(item);
+
+	if (!query || !query->server) {
+		goto end;
+	}
+
+	CMD_IRC_SERVER(server);
+	if (!IS_IRC_QUERY(query)) {
+		goto end;
+	}
+
+	if (!server || !server->connected) {
+		cmd_return_error(CMDERR_NOT_CONNECTED);
+	}
+
+	signal_stop();
+	post_msg_job(SERVER(server), window_item_get_target(item), data, NULL,
+			me_job);
+
+end:
+	return;
+}
+
+/*
+ * /otr command handed to the worker.
+ */
+struct cmd_job {
+	SERVER_REC *irssi;
+	char *target;
+	char *cmd;
+	char *data;
+};
+
+static void cmd_job_free(void *data)
+{
+	struct cmd_job *job = data;
+
+	free(job->target);
+	free(job->cmd);
+	free(job->data);
+	free(job);
+}
+
+static void cmd_job(void *data)
+{
+	struct cmd_job *job = data;
+
+	cmd_generic(user_state_global, job->irssi, job->target, job->cmd,
+			job->data);
+
+	otr_status_redraw();
+}
+
+static void cmd_alive_job(void *data)
+{
+	IRSSI_INFO(NULL, NULL, "Fragment reassembly memory: %lu bytes",
+			(unsigned long) fragment_mem_usage());
+}
+
 /*
  * Handle the "/otr" command.
  */
@@ -205,14 +524,19 @@ static void cmd_otr(const char *data, void *server, WI_ITEM_REC *item)
 {
 	char *cmd = NULL;
 	QUERY_REC *query;
+	struct cmd_job *job;
 
-	query = QUERY(item);
+	if (otr_start() < 0) {
+		goto end;
+	}
 
-	/* Check key generation state. */
-	key_gen_check();
+	query = QUERY(item);
 
 	if (*data == '\0') {
 		IRSSI_INFO(NULL, NULL, "Alive!");
+		IRSSI_INFO(NULL, NULL, "Outbound queue: %lu bytes",
+				(unsigned long) sched_queued_bytes());
+		otr_post_job(NULL, NULL, cmd_alive_job, NULL, NULL);
 		goto end;
 	}
 
@@ -222,27 +546,111 @@ static void cmd_otr(const char *data, void *server, WI_ITEM_REC *item)
 		goto end;
 	}
 
+	job = zmalloc(sizeof(*job));
+	if (!job) {
+		free(cmd);
+		goto end;
+	}
+	job->cmd = cmd;
+	job->data = strdup(data);
+
 	if (query && query->server && query->server->connrec) {
-		cmd_generic(user_state_global, query->server, query->name, cmd, data);
-	} else {
-		cmd_generic(user_state_global, NULL, NULL, cmd, data);
+		job->irssi = query->server;
+		job->target = strdup(query->name);
 	}
 
-	statusbar_items_redraw("otr");
+	if (!job->data || (job->irssi && !job->target)) {
+		cmd_job_free(job);
+		goto end;
+	}
 
-	free(cmd);
+	otr_post_job(job->irssi, job->target, cmd_job, job, cmd_job_free);
 
 end:
 	return;
 }
 
+static void load_job(void *data)
+{
+	otr_load_user_state(user_state_global);
+}
+
+static void merge_job(void *data)
+{
+	if (user_state_global) {
+		key_merge_files(user_state_global);
+	}
+}
+
+/*
+ * A file of the OTR directory was written, by us or by another Irssi instance
+ * sharing it. The merge job tells them apart.
+ */
+static void files_changed_cb(const char *name)
+{
+	if (key_file_shared(name)) {
+		otr_post_job(NULL, NULL, merge_job, NULL, NULL);
+	}
+}
+
+static void finishall_job(void *data)
+{
+	otr_finishall(user_state_global);
+}
+
+static void keygen_deinit_job(void *data)
+{
+	key_gen_deinit();
+}
+
+static void key_pool_job(void *data)
+{
+	key_pool_resize(GPOINTER_TO_UINT(data));
+}
+
+/*
+ * Parse the per network message sizes again and hand the key pool size to
+ * the worker when it changes.
+ */
+static void sig_setup_changed(void)
+{
+	static int pool_size = -1;
+	int size;
+
+	if (otr_started <= 0) {
+		return;
+	}
+
+	otr_load_msg_size_networks();
+
+	size = MAX(settings_get_int(OTR_SET_KEY_POOL_SIZE), 0);
+	if (size == pool_size) {
+		return;
+	}
+
+	pool_size = size;
+	otr_post_job(NULL, NULL, key_pool_job, GUINT_TO_POINTER(size), NULL);
+}
+
 /*
  * Optionally finish conversations on /quit. We're already doing this on unload
- * but the quit handler terminates irc connections before unloading.
+ * but the quit handler terminates irc connections before unloading. The
+ * worker is waited for, which also runs the sends it deferred, and the flood
+ * control is bypassed so the messages go out before the connections close.
  */
 static void cmd_quit(const char *data, void *server, WI_ITEM_REC *item)
 {
-	otr_finishall(user_state_global);
+	GSList *tmp;
+
+	if (otr_started <= 0) {
+		return;
+	}
+
+	worker_sync(finishall_job, NULL);
+
+	for (tmp = servers; tmp; tmp = tmp->next) {
+		otr_server_flush(tmp->data);
+	}
 }
 
 /*
@@ -254,7 +662,8 @@ static void otr_statusbar(struct SBAR_ITEM_REC *item, int get_size_only)
 	QUERY_REC *query = QUERY(wi);
 	enum otr_status_format formatnum = TXT_OTR_MODULE_NAME;
 
-	if (query && query->server && query->server->connrec) {
+	if (otr_started > 0 && query && query->server &&
+			query->server->connrec) {
 		formatnum = otr_get_status_format(query->server, query->name);
 	}
 
@@ -309,20 +718,29 @@ void irssi_send_message(SERVER_REC *irssi, const char *recipient,
 }
 
 /*
- * irssi init()
+ * Set up gcrypt, libotr, the user state and the worker, load the files and
+ * track the connected servers. Done when the module loads or, with
+ * otr_lazy_init, on the first use of OTR.
+ *
+ * Return 0 on success or else a negative value.
  */
-void otr_init(void)
+static int otr_start(void)
 {
 	int ret;
+	char *dir_path;
+	GSList *tmp;
    gcry_error_t err;
 
-	module_register(MODULE_NAME, "core");
+	if (otr_started) {
+		return otr_started > 0 ? 0 : -1;
+	}
 
-	theme_register(otr_formats);
+	/* Not tried again. */
+	otr_started = -1;
 
 	ret = create_module_dir();
 	if (ret < 0) {
-		return;
+		return -1;
 	}
 
    if( !gcry_control (GCRYCTL_ANY_INITIALIZATION_P) )
@@ -332,19 +750,19 @@ void otr_init(void)
       if( (err = gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread)) )
       {
          IRSSI_MSG("irssi-otr: gcry_control (GCRYCTL_SET_THREAD_CBS) failed: %s", gcry_strerror (err));
-         return;
+         return -1;
       }
 # endif
       if( !gcry_check_version(GCRYPT_VERSION) )
       {
          IRSSI_MSG("irssi-otr: gcry_check_version(GCRYPT_VERSION) failed");
-         return;
+         return -1;
       }
       gcry_control(GCRYCTL_SUSPEND_SECMEM_WARN);
       if ((err = gcry_control(GCRYCTL_INIT_SECMEM, 32768, 0)) )
       {
          IRSSI_MSG("irssi-otr: gcry_control (GCRYCTL_INIT_SECMEM) failed: %s", gcry_strerror(err));
-         return;
+         return -1;
       }
       gcry_control (GCRYCTL_RESUME_SECMEM_WARN);
       gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
@@ -355,12 +773,81 @@ void otr_init(void)
 	user_state_global = otr_init_user_state();
 	if (!user_state_global) {
 		IRSSI_MSG("Unable to allocate user global state");
+		otr_lib_uninit();
+		return -1;
+	}
+
+	otr_started = 1;
+
+	/* On error, OTR runs in the main loop. */
+	worker_init();
+
+	/* Jobs posted until the files are loaded wait behind this one. */
+	otr_post_job(NULL, NULL, load_job, NULL, NULL);
+
+	/* Track the servers that are already connected, once loaded. */
+	for (tmp = servers; tmp; tmp = tmp->next) {
+		otr_server_update(tmp->data);
+	}
+
+	/* Changes of other Irssi instances sharing the OTR directory. */
+	ret = asprintf(&dir_path, "%s%s", get_client_config_dir(), OTR_DIR);
+	if (ret >= 0) {
+		watch_init(dir_path, files_changed_cb);
+		free(dir_path);
+	}
+
+	sig_setup_changed();
+	statusbar_items_redraw("window");
+
+	return 0;
+}
+
+/*
+ * irssi init()
+ */
+void otr_init(void)
+{
+	module_register(MODULE_NAME, "core");
+
+	theme_register(otr_formats);
+
+	/* Outbound scheduler token bucket. */
+	settings_add_int("otr", OTR_SET_FLOOD_LINES, 5);
+	settings_add_time("otr", OTR_SET_FLOOD_LINE_INTERVAL, "1s");
+	settings_add_int("otr", OTR_SET_FLOOD_BYTES, 2560);
+	settings_add_int("otr", OTR_SET_FLOOD_BYTES_PER_SEC, 1024);
+
+	/* Message size, computed from the IRC line budget by default. */
+	settings_add_int("otr", OTR_SET_MAX_MSG_SIZE, 0);
+	settings_add_str("otr", OTR_SET_MAX_MSG_SIZE_NETWORKS, "");
+
+	/* One libotr state per account, read when the module is loaded. */
+	settings_add_bool("otr", OTR_SET_SHARD_ACCOUNTS, FALSE);
+
+	/* Accounts loaded while connected only, read when the module loads. */
+	settings_add_bool("otr", OTR_SET_LAZY_ACCOUNTS, FALSE);
+
+	/* Fingerprint journal, read when the module loads. */
+	settings_add_bool("otr", OTR_SET_FP_JOURNAL, FALSE);
+
+	/* Spare keys generated in the background for new accounts. */
+	settings_add_int("otr", OTR_SET_KEY_POOL_SIZE, 0);
+
+	/* Crypto set up on first use, read when the module loads. */
+	settings_add_bool("otr", OTR_SET_LAZY_INIT, FALSE);
+
+	if (!settings_get_bool(OTR_SET_LAZY_INIT) && otr_start() < 0) {
 		return;
 	}
 
 	signal_add_first("server sendmsg", (SIGNAL_FUNC) sig_server_sendmsg);
 	signal_add_first("message private", (SIGNAL_FUNC) sig_message_private);
 	signal_add("query destroyed", (SIGNAL_FUNC) sig_query_destroyed);
+	signal_add("server connected", (SIGNAL_FUNC) sig_server_connected);
+	signal_add("server nick changed", (SIGNAL_FUNC) sig_server_nick_changed);
+	signal_add("server disconnected", (SIGNAL_FUNC) sig_server_disconnected);
+	signal_add("setup changed", (SIGNAL_FUNC) sig_setup_changed);
 
 	command_bind("otr", NULL, (SIGNAL_FUNC) cmd_otr);
 	command_bind_first("quit", NULL, (SIGNAL_FUNC) cmd_quit);
@@ -377,9 +864,15 @@ void otr_init(void)
  */
 void otr_deinit(void)
 {
+	GSList *tmp;
+
 	signal_remove("server sendmsg", (SIGNAL_FUNC) sig_server_sendmsg);
 	signal_remove("message private", (SIGNAL_FUNC) sig_message_private);
 	signal_remove("query destroyed", (SIGNAL_FUNC) sig_query_destroyed);
+	signal_remove("server connected", (SIGNAL_FUNC) sig_server_connected);
+	signal_remove("server nick changed", (SIGNAL_FUNC) sig_server_nick_changed);
+	signal_remove("server disconnected", (SIGNAL_FUNC) sig_server_disconnected);
+	signal_remove("setup changed", (SIGNAL_FUNC) sig_setup_changed);
 
 	command_unbind("otr", (SIGNAL_FUNC) cmd_otr);
 	command_unbind("quit", (SIGNAL_FUNC) cmd_quit);
@@ -387,15 +880,37 @@ void otr_deinit(void)
 
 	statusbar_item_unregister("otr");
 
-	otr_finishall(user_state_global);
+	if (otr_started <= 0) {
+		goto end;
+	}
+
+	watch_deinit();
+
+	worker_sync(finishall_job, NULL);
+	worker_sync(keygen_deinit_job, NULL);
+
+	/* Wait for the worker and run what it left for the main loop. */
+	worker_deinit();
+
+	/* Forced flush of the coalesced writes. */
+	key_write_deinit();
 
 	/* Remove glib timer if any. */
 	otr_control_timer(0, NULL);
 
 	otr_free_user_state(user_state_global);
+	user_state_global = NULL;
+
+	/* Release the module data of the servers still connected. */
+	for (tmp = servers; tmp; tmp = tmp->next) {
+		otr_server_free(tmp->data);
+	}
 
 	otr_lib_uninit();
 
+	otr_started = 0;
+
+end:
 	theme_unregister();
 }
 
@@ -21,7 +21,7 @@
 #ifndef IRSSI_OTR_MODULE
 #define IRSSI_OTR_MODULE
 
-void sig_message_private(SERVER_REC *server, const char *msg,
-		const char *nick, const char *address);
+void irssi_deliver_message(SERVER_REC *irssi, const char *msg,
+		const char *nick, const char *address, int action);
 
 #endif /* IRSSI_OTR_MODULE */
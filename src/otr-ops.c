@@ -26,13 +26,18 @@ static OtrlPolicy OTR_DEFAULT_POLICY =
 	OTRL_POLICY_MANUAL | OTRL_POLICY_WHITESPACE_START_AKE;
 
 /*
- * Return default policy for now.
+ * Return the policy of the conversation with nick. Default policy for now.
  */
-static OtrlPolicy ops_policy(void *opdata, ConnContext *context)
+OtrlPolicy otr_policy(SERVER_REC *irssi, const char *nick)
 {
 	return OTR_DEFAULT_POLICY;
 }
 
+static OtrlPolicy ops_policy(void *opdata, ConnContext *context)
+{
+	return otr_policy(opdata, context->username);
+}
+
 /*
  * Request for key generation.
  *
@@ -55,7 +60,7 @@ static void ops_inject_msg(void *opdata, const char *accountname,
 	SERVER_REC *irssi = opdata;
 
 	IRSSI_DEBUG("Inject msg:\n[%s]", message);
-	irssi_send_message(irssi, recipient, message);
+	otr_inject_message(irssi, recipient, message);
 }
 
 /*
@@ -68,6 +73,7 @@ static void ops_secure(void *opdata, ConnContext *context)
 	char peerfp[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
 	SERVER_REC *irssi = opdata;
 	struct otr_peer_context *opc;
+	struct otr_user_state *ustate;
 
 	assert(context);
 	/* This should *really* not happened */
@@ -88,7 +94,8 @@ static void ops_secure(void *opdata, ConnContext *context)
 	/* Not authenticated. Let's print out the fingerprints for comparison. */
 	otrl_privkey_hash_to_human(peerfp,
 			context->active_fingerprint->fingerprint);
-	otrl_privkey_fingerprint(user_state_global->otr_state, ownfp,
+	ustate = otr_user_state_shard(user_state_global, context->accountname);
+	otrl_privkey_fingerprint(ustate->otr_state, ownfp,
 			context->accountname, OTR_PROTOCOL_ID);
 
 	IRSSI_NOTICE(irssi, context->username, "Your peer is not "
@@ -121,11 +128,13 @@ static void ops_insecure(void *opdata, ConnContext *context)
 
 /*
  * Really critical with IRC. Unfortunately, we can't tell our peer which size
- * to use.
+ * to use so it is computed from the line budget of the server.
  */
 static int ops_max_msg(void *opdata, ConnContext *context)
 {
-	return OTR_MAX_MSG_SIZE;
+	SERVER_REC *irssi = opdata;
+
+	return otr_max_msg_size(irssi, context->username);
 }
 
 static void ops_handle_msg_event(void *opdata, OtrlMessageEvent msg_event,
@@ -198,17 +207,8 @@ static void ops_handle_msg_event(void *opdata, OtrlMessageEvent msg_event,
 		IRSSI_NOTICE(server, username,
 				"The following message from %9%s%9 was NOT "
 				"encrypted.", username);
-		/*
-		 * This is a hack I found to send the message in a private window of
-		 * the username without creating an infinite loop since the 'message
-		 * private' signal is hijacked in this module. If someone is able to
-		 * clean this up with a more elegant solution, by all means PLEASE
-		 * submit a patch or email me a better way.
-		 */
-		signal_remove("message private", (SIGNAL_FUNC) sig_message_private);
-		signal_emit("message private", 4, server, message, username,
-				IRSSI_CONN_ADDR(server));
-		signal_add_first("message private", (SIGNAL_FUNC) sig_message_private);
+		/* Delivered by the main loop, past our own signal handler. */
+		irssi_deliver_message(server, message, username, NULL, 0);
 		break;
 	case OTRL_MSGEVENT_RCVDMSG_UNRECOGNIZED:
 		IRSSI_NOTICE(server, username, "Unrecognized OTR message "
@@ -229,6 +229,16 @@ static void ops_up_ctx_list(void *opdata)
 	otr_status_change(opdata, NULL, OTR_STATUS_CTX_UPDATE);
 }
 
+/*
+ * A new fingerprint was seen and added by libotr.
+ */
+static void ops_new_fingerprint(void *opdata, OtrlUserState us,
+		const char *accountname, const char *protocol, const char *username,
+		unsigned char fingerprint[20])
+{
+	otr_fp_index_add(accountname, username, fingerprint);
+}
+
 /*
  * Save fingerprint changes.
  */
@@ -260,9 +270,7 @@ static int ops_is_logged_in(void *opdata, const char *accountname,
 static void ops_create_instag(void *opdata, const char *accountname,
 		const char *protocol)
 {
-	otrl_instag_generate(user_state_global->otr_state, "/dev/null",
-			accountname, protocol);
-	key_write_instags(user_state_global);
+	key_gen_instag(user_state_global, accountname, protocol);
 }
 
 static void ops_smp_event(void *opdata, OtrlSMPEvent smp_event,
@@ -380,7 +388,7 @@ OtrlMessageAppOps otr_ops = {
 	ops_is_logged_in,
 	ops_inject_msg,
 	ops_up_ctx_list,
-	NULL, /* new_fingerprint */
+	ops_new_fingerprint,
 	ops_write_fingerprints,
 	ops_secure,
 	ops_insecure,
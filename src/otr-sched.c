@@ -0,0 +1,412 @@
+/*
+ * Off-the-Record Messaging (OTR) modules for IRC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301,USA
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <string.h>
+
+#include "otr-sched.h"
+#include "otr.h"
+
+/*
+ * Message waiting in the queue of a peer.
+ */
+struct otr_sched_item {
+	char *msg;
+	size_t len;
+	enum otr_sched_priority prio;
+};
+
+/*
+ * Queue of messages for one target.
+ */
+struct otr_sched_peer {
+	char *target;
+	GQueue items;
+	/* Link in the active list of the scheduler if items are pending. */
+	GList *active_link;
+};
+
+/* Bytes waiting in the queues of all servers. */
+static size_t sched_total_bytes;
+
+/*
+ * Set while the scheduler hands a message to irssi so the "server sendmsg"
+ * handler does not route it through OTR nor queue it again.
+ */
+static int sched_sending;
+
+static void item_free(struct otr_sched_item *item)
+{
+	free(item->msg);
+	free(item);
+}
+
+static void peer_free(gpointer data)
+{
+	struct otr_sched_peer *peer = data;
+	struct otr_sched_item *item;
+
+	while ((item = g_queue_pop_head(&peer->items))) {
+		item_free(item);
+	}
+	free(peer->target);
+	free(peer);
+}
+
+/*
+ * Refill the token bucket according to the time elapsed since last refill.
+ */
+static void refill(struct otr_sched *sched, int max_lines, int max_bytes)
+{
+	int line_interval, bytes_per_sec;
+	gint64 now, elapsed;
+
+	now = g_get_monotonic_time();
+	elapsed = now - sched->last_refill;
+	sched->last_refill = now;
+
+	line_interval = settings_get_time(OTR_SET_FLOOD_LINE_INTERVAL);
+	bytes_per_sec = settings_get_int(OTR_SET_FLOOD_BYTES_PER_SEC);
+
+	if (line_interval > 0) {
+		sched->line_tokens += (double) elapsed / (line_interval * 1000.0);
+	} else {
+		sched->line_tokens = max_lines;
+	}
+	if (sched->line_tokens > max_lines) {
+		sched->line_tokens = max_lines;
+	}
+
+	if (bytes_per_sec > 0) {
+		sched->byte_tokens += (double) elapsed * bytes_per_sec / 1000000.0;
+	} else {
+		sched->byte_tokens = max_bytes;
+	}
+	if (sched->byte_tokens > max_bytes) {
+		sched->byte_tokens = max_bytes;
+	}
+}
+
+/*
+ * Return the msec to wait until the bucket holds enough tokens for len bytes.
+ */
+static guint refill_delay(struct otr_sched *sched, size_t len, int max_bytes)
+{
+	int line_interval, bytes_per_sec;
+	double wait = 0, bytes;
+
+	line_interval = settings_get_time(OTR_SET_FLOOD_LINE_INTERVAL);
+	bytes_per_sec = settings_get_int(OTR_SET_FLOOD_BYTES_PER_SEC);
+
+	if (sched->line_tokens < 1) {
+		wait = (1 - sched->line_tokens) * line_interval;
+	}
+
+	/* A message bigger than the bucket waits for a full bucket. */
+	bytes = len < (size_t) max_bytes ? len : max_bytes;
+	if (sched->byte_tokens < bytes && bytes_per_sec > 0) {
+		double byte_wait = (bytes - sched->byte_tokens) * 1000 / bytes_per_sec;
+		if (byte_wait > wait) {
+			wait = byte_wait;
+		}
+	}
+
+	if (wait < OTR_SCHED_MIN_DELAY) {
+		wait = OTR_SCHED_MIN_DELAY;
+	}
+
+	return (guint) wait;
+}
+
+/*
+ * Pick the next peer to serve. Peers whose next message is protocol traffic
+ * come first, then the round robin order.
+ */
+static struct otr_sched_peer *next_peer(struct otr_sched *sched)
+{
+	GList *link;
+	struct otr_sched_peer *peer;
+	struct otr_sched_item *item;
+
+	for (link = sched->active.head; link; link = link->next) {
+		peer = link->data;
+		item = g_queue_peek_head(&peer->items);
+		if (item->prio == OTR_SCHED_CONTROL) {
+			return peer;
+		}
+	}
+
+	link = sched->active.head;
+	return link ? link->data : NULL;
+}
+
+static void send_item(struct otr_sched *sched, struct otr_sched_peer *peer,
+		struct otr_sched_item *item)
+{
+	IRSSI_DEBUG("Sched: sending %lu bytes to %s",
+			(unsigned long) item->len, peer->target);
+
+	sched_send_now(sched->irssi, peer->target, item->msg);
+}
+
+static void sched_pump(struct otr_sched *sched);
+
+static gboolean timer_cb(gpointer data)
+{
+	struct otr_sched *sched = data;
+
+	sched->timer = 0;
+	sched_pump(sched);
+
+	return FALSE;
+}
+
+/*
+ * Send as many queued messages as the token bucket allows and arm a timer for
+ * the rest.
+ */
+static void sched_pump(struct otr_sched *sched)
+{
+	int max_lines, max_bytes;
+	double bytes;
+	struct otr_sched_peer *peer;
+	struct otr_sched_item *item;
+
+	max_lines = settings_get_int(OTR_SET_FLOOD_LINES);
+	max_bytes = settings_get_int(OTR_SET_FLOOD_BYTES);
+	if (max_bytes < 1) {
+		max_bytes = 1;
+	}
+
+	refill(sched, max_lines, max_bytes);
+
+	while ((peer = next_peer(sched))) {
+		item = g_queue_peek_head(&peer->items);
+
+		bytes = item->len < (size_t) max_bytes ? item->len : max_bytes;
+		if (max_lines > 0 && (sched->line_tokens < 1 ||
+					sched->byte_tokens < bytes)) {
+			if (!sched->timer) {
+				sched->timer = g_timeout_add(
+						refill_delay(sched, item->len, max_bytes),
+						timer_cb, sched);
+			}
+			break;
+		}
+
+		g_queue_pop_head(&peer->items);
+		sched->queued_bytes -= item->len;
+		sched_total_bytes -= item->len;
+		sched->line_tokens -= 1;
+		sched->byte_tokens -= bytes;
+
+		/* Round robin, the peer goes at the end if it has more. */
+		g_queue_unlink(&sched->active, peer->active_link);
+		if (g_queue_is_empty(&peer->items)) {
+			g_list_free_1(peer->active_link);
+			peer->active_link = NULL;
+		} else {
+			g_queue_push_tail_link(&sched->active, peer->active_link);
+		}
+
+		send_item(sched, peer, item);
+		item_free(item);
+
+		if (!peer->active_link) {
+			g_hash_table_remove(sched->peers, peer->target);
+		}
+	}
+}
+
+/*
+ * Create the outbound scheduler of a server.
+ */
+struct otr_sched *sched_new(SERVER_REC *irssi)
+{
+	struct otr_sched *sched;
+
+	assert(irssi);
+
+	sched = zmalloc(sizeof(*sched));
+	if (!sched) {
+		goto error;
+	}
+
+	sched->peers = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+			peer_free);
+	sched->irssi = irssi;
+	sched->line_tokens = settings_get_int(OTR_SET_FLOOD_LINES);
+	sched->byte_tokens = settings_get_int(OTR_SET_FLOOD_BYTES);
+	sched->last_refill = g_get_monotonic_time();
+
+error:
+	return sched;
+}
+
+/*
+ * Send all pending messages right away regardless of the token bucket.
+ */
+void sched_flush(struct otr_sched *sched)
+{
+	struct otr_sched_peer *peer;
+	struct otr_sched_item *item;
+
+	if (!sched) {
+		return;
+	}
+
+	while ((peer = next_peer(sched))) {
+		while ((item = g_queue_pop_head(&peer->items))) {
+			sched->queued_bytes -= item->len;
+			sched_total_bytes -= item->len;
+			send_item(sched, peer, item);
+			item_free(item);
+		}
+
+		g_queue_delete_link(&sched->active, peer->active_link);
+		peer->active_link = NULL;
+		g_hash_table_remove(sched->peers, peer->target);
+	}
+}
+
+/*
+ * Drop the pending messages and free the scheduler.
+ */
+void sched_free(struct otr_sched *sched)
+{
+	GList *link;
+	struct otr_sched_peer *peer;
+
+	if (!sched) {
+		return;
+	}
+
+	if (sched->timer) {
+		g_source_remove(sched->timer);
+	}
+
+	for (link = sched->active.head; link; link = link->next) {
+		peer = link->data;
+		peer->active_link = NULL;
+	}
+	g_queue_clear(&sched->active);
+
+	sched_total_bytes -= sched->queued_bytes;
+	g_hash_table_destroy(sched->peers);
+	free(sched);
+}
+
+/*
+ * Queue a message for the target and send what the token bucket allows.
+ */
+void sched_send(struct otr_sched *sched, const char *target, const char *msg,
+		enum otr_sched_priority prio)
+{
+	struct otr_sched_peer *peer;
+	struct otr_sched_item *item;
+
+	assert(sched);
+	assert(target);
+	assert(msg);
+
+	item = zmalloc(sizeof(*item));
+	if (!item) {
+		goto error;
+	}
+
+	item->msg = strdup(msg);
+	if (!item->msg) {
+		goto error_msg;
+	}
+	item->len = strlen(msg);
+	item->prio = prio;
+
+	peer = g_hash_table_lookup(sched->peers, target);
+	if (!peer) {
+		peer = zmalloc(sizeof(*peer));
+		if (!peer) {
+			goto error_peer;
+		}
+		peer->target = strdup(target);
+		if (!peer->target) {
+			free(peer);
+			goto error_peer;
+		}
+		g_hash_table_insert(sched->peers, peer->target, peer);
+	}
+
+	g_queue_push_tail(&peer->items, item);
+	sched->queued_bytes += item->len;
+	sched_total_bytes += item->len;
+
+	if (!peer->active_link) {
+		g_queue_push_tail(&sched->active, peer);
+		peer->active_link = sched->active.tail;
+	}
+
+	sched_pump(sched);
+	return;
+
+error_peer:
+	free(item->msg);
+error_msg:
+	free(item);
+error:
+	IRSSI_DEBUG("Sched: unable to queue message for %s", target);
+	return;
+}
+
+/*
+ * Return 1 if messages are waiting to be sent to the target.
+ */
+int sched_pending(struct otr_sched *sched, const char *target)
+{
+	if (!sched || !target) {
+		return 0;
+	}
+
+	return g_hash_table_lookup(sched->peers, target) != NULL;
+}
+
+/*
+ * Hand a message to irssi right away, without going through the queues nor
+ * the token bucket. Irssi's own flood control still applies.
+ */
+void sched_send_now(SERVER_REC *irssi, const char *target, const char *msg)
+{
+	sched_sending = 1;
+	irssi_send_message(irssi, target, msg);
+	sched_sending = 0;
+}
+
+/*
+ * Return 1 if the scheduler is handing a message to irssi.
+ */
+int sched_in_send(void)
+{
+	return sched_sending;
+}
+
+/*
+ * Return the bytes waiting in the queues of all servers.
+ */
+size_t sched_queued_bytes(void)
+{
+	return sched_total_bytes;
+}
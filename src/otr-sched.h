@@ -0,0 +1,79 @@
+/*
+ * Off-the-Record Messaging (OTR) modules for IRC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301,USA
+ */
+
+#ifndef IRSSI_OTR_SCHED_H
+#define IRSSI_OTR_SCHED_H
+
+#include <glib.h>
+#include <stddef.h>
+
+#include "irssi-otr.h"
+
+/*
+ * Settings of the outbound token bucket. Setting otr_flood_lines to 0
+ * disables pacing and messages are sent right away.
+ */
+#define OTR_SET_FLOOD_LINES           "otr_flood_lines"
+#define OTR_SET_FLOOD_LINE_INTERVAL   "otr_flood_line_interval"
+#define OTR_SET_FLOOD_BYTES           "otr_flood_bytes"
+#define OTR_SET_FLOOD_BYTES_PER_SEC   "otr_flood_bytes_per_sec"
+
+/* Shortest delay in msec before retrying to send from a paced queue. */
+#define OTR_SCHED_MIN_DELAY           50
+
+enum otr_sched_priority {
+	/* Protocol traffic (AKE, SMP, ...) goes first. */
+	OTR_SCHED_CONTROL		= 0,
+	/* Fragments of user data. */
+	OTR_SCHED_BULK			= 1,
+};
+
+/*
+ * Outbound scheduler of a server. Messages are kept in a FIFO per peer so
+ * ordering is preserved for a peer and peers are served in a round robin
+ * fashion, the ones with protocol traffic first. A token bucket sized in
+ * bytes and lines paces the output to stay under the server flood limits.
+ */
+struct otr_sched {
+	SERVER_REC *irssi;
+	/* Target nickname to struct otr_sched_peer. */
+	GHashTable *peers;
+	/* Peers with pending messages in round robin order. */
+	GQueue active;
+	/* Available tokens. */
+	double line_tokens;
+	double byte_tokens;
+	/* Monotonic time of the last refill in usec. */
+	gint64 last_refill;
+	/* Glib timer waiting for tokens. */
+	guint timer;
+	/* Bytes waiting in the queues of this server. */
+	size_t queued_bytes;
+};
+
+struct otr_sched *sched_new(SERVER_REC *irssi);
+void sched_free(struct otr_sched *sched);
+void sched_flush(struct otr_sched *sched);
+void sched_send(struct otr_sched *sched, const char *target, const char *msg,
+		enum otr_sched_priority prio);
+int sched_pending(struct otr_sched *sched, const char *target);
+void sched_send_now(SERVER_REC *irssi, const char *target, const char *msg);
+int sched_in_send(void);
+size_t sched_queued_bytes(void);
+
+#endif /* IRSSI_OTR_SCHED_H */
@@ -22,6 +22,7 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <gcrypt.h>
+#include <sys/file.h>
 #include <unistd.h>
 
 #include "otr-formats.h"
@@ -45,35 +46,359 @@ static const char *statusbar_txt[] = {
 	"CTX_UPDATE"
 };
 
-/* Glib timer for otr. */
+/*
+ * Set while libotr handles a message of the user. Messages injected in that
+ * time are fragments of user data, others are protocol traffic.
+ */
+static int otr_sending;
+
+/* Glib timer for otr. Owned by the main loop. */
 static guint otr_timerid;
+static unsigned int otr_timer_armed;
+/* Set while a timer job is waiting for the worker. */
+static int otr_timer_job_pending;
+
+/*
+ * Shortest interval requested by libotr over the libotr states and last
+ * interval handed to the main loop. Owned by the worker.
+ */
+static unsigned int otr_timer_interval;
+static unsigned int otr_timer_requested;
+
+/* State being polled, its timer_control calls are about it. */
+static struct otr_user_state *otr_poll_state;
+
+/*
+ * Key of the context index. The strings are owned by the key.
+ */
+struct otr_context_key {
+	char *accname;
+	char *nick;
+};
+
+/*
+ * Index of the master contexts keyed by (account name, nick). This avoids
+ * walking the sorted libotr context list on each lookup. Entries are added on
+ * the first lookup of a context and removed by the peer context destroy
+ * callback when libotr frees the context (forget, user state free).
+ */
+static GHashTable *context_index;
+
+/*
+ * Account name to the queue of its Irssi server records in connection order,
+ * several connections sharing an account behind a bouncer. Keys are the
+ * interned account names of the server module data so they are never freed.
+ * They are compared ignoring the case, as nicks and addresses are.
+ */
+static GHashTable *server_index;
+
+/*
+ * otr_max_msg_size_networks parsed when the settings change. Chat network or
+ * server tag, compared ignoring the case, to struct otr_network_size.
+ */
+static GHashTable *network_sizes;
+
+struct otr_network_size {
+	int size;
+	/* Position in the setting, the first pair matching a server wins. */
+	int pos;
+};
+
+/*
+ * Status bar format of the conversations keyed by (account name, nick). The
+ * contexts belong to the worker so it publishes the formats here for the
+ * status bar which is drawn by the main loop.
+ */
+static GHashTable *status_mirror;
+
+/*
+ * Status bar formats computed by the worker and published to the main loop.
+ */
+struct otr_status_publish {
+	SERVER_REC *irssi;
+	char *nick;
+	/* Event to emit or a negative value for none. */
+	int event;
+	/* List of struct otr_status_entry. */
+	GSList *entries;
+};
+
+struct otr_status_entry {
+	struct otr_context_key key;
+	enum otr_status_format format;
+	/* The context was forgotten, drop it from the mirror. */
+	int removed;
+};
+
+/*
+ * Status change waiting to be flushed from the main loop.
+ */
+struct otr_status_pending {
+	SERVER_REC *irssi;
+	char *nick;
+	enum otr_status_event event;
+};
+
+/*
+ * Status changes are coalesced and flushed once per main loop iteration
+ * from an idle source so a burst of protocol events (AKE, SMP) results in a
+ * single statusbar redraw. Entries are kept in reverse order of arrival.
+ */
+static GSList *status_pending;
+static guint status_flush_source;
+
+static void status_publish_removed(const struct otr_context_key *key);
+
+/*
+ * Fingerprint index entry. Only the identity of the fingerprint is kept and
+ * resolved to the libotr object on lookup so a fingerprint freed by libotr
+ * never leaves a dangling pointer here. Entries of the same hash known under
+ * different contexts are chained.
+ */
+struct otr_fp_entry {
+	unsigned char hash[20];
+	char *accname;
+	char *username;
+	struct otr_fp_entry *next;
+};
+
+/* Fingerprint hash to chain of entries. */
+static GHashTable *fp_index;
 
 /*
- * Allocate and return a string containing the account name of the Irssi server
- * record.
+ * Heads of the chains sorted by hash. Used to find a fingerprint from a
+ * leading part of its human readable form with a binary search.
+ */
+static struct otr_fp_entry **fp_sorted;
+static size_t fp_sorted_len, fp_sorted_size;
+
+/*
+ * Per server record data of the module. Attached to the irssi server record
+ * with MODULE_DATA_SET() and released when the server disconnects.
+ */
+struct otr_server_data {
+	/*
+	 * Interned account name of the server (nick@myserver.net). Interned
+	 * strings are never freed so this pointer can be handed around freely.
+	 */
+	const char *accname;
+	/* Outbound scheduler pacing the OTR messages sent to this server. */
+	struct otr_sched *sched;
+};
+
+/*
+ * Build the interned account name of the Irssi server record.
  *
- * Return: nick@myserver.net
+ * Return: nick@myserver.net or NULL on error.
  */
-static char *create_account_name(SERVER_REC *irssi)
+static const char *build_account_name(SERVER_REC *irssi)
 {
 	int ret;
 	char *accname;
+	const char *interned;
 
 	assert(irssi);
 
-	/* Valid or NULL, the caller should handle this */
 	ret = asprintf(&accname, "%s@%s", IRSSI_NICK(irssi),
 			IRSSI_CONN_ADDR(irssi));
 	if (ret < 0) {
 		IRSSI_INFO(NULL, NULL, "Unable to allocate account name.");
-		/*
-		 * As stated in asprintf(3), if an error occurs, the contents of the
-		 * passed pointer is undefined. Force it to NULL here.
-		 */
-		accname = NULL;
+		return NULL;
+	}
+
+	interned = g_intern_string(accname);
+	free(accname);
+
+	return interned;
+}
+
+/*
+ * Hash of an account name ignoring the case.
+ */
+static guint account_name_hash(gconstpointer data)
+{
+	const char *p;
+	guint hash = 5381;
+
+	for (p = data; *p; p++) {
+		hash = (hash << 5) + hash + g_ascii_tolower(*p);
+	}
+
+	return hash;
+}
+
+static gboolean account_name_equal(gconstpointer a, gconstpointer b)
+{
+	return g_ascii_strcasecmp(a, b) == 0;
+}
+
+/*
+ * Return the module data of the server record, allocating it if needed.
+ */
+static struct otr_server_data *get_server_data(SERVER_REC *irssi)
+{
+	struct otr_server_data *data;
+
+	assert(irssi);
+
+	data = MODULE_DATA(irssi);
+	if (!data) {
+		data = zmalloc(sizeof(*data));
+		if (!data) {
+			goto end;
+		}
+		/* On error, messages are sent without pacing. */
+		data->sched = sched_new(irssi);
+		MODULE_DATA_SET(irssi, data);
+	}
+
+end:
+	return data;
+}
+
+/*
+ * Add a server record to the servers of an account.
+ *
+ * Return the number of servers with exactly this account name.
+ */
+static int server_index_add(const char *accname, SERVER_REC *irssi)
+{
+	int count = 0;
+	GList *link;
+	GQueue *servers;
+	struct otr_server_data *data;
+
+	servers = g_hash_table_lookup(server_index, accname);
+	if (!servers) {
+		servers = g_queue_new();
+		g_hash_table_insert(server_index, (gpointer) accname, servers);
+	}
+	if (!g_queue_find(servers, irssi)) {
+		g_queue_push_tail(servers, irssi);
+	}
+
+	for (link = servers->head; link; link = link->next) {
+		data = MODULE_DATA((SERVER_REC *) link->data);
+		if (link->data == irssi || (data && data->accname == accname)) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Remove a server record from the servers of an account.
+ *
+ * Return the number of other servers left with exactly this account name.
+ */
+static int server_index_remove(const char *accname, SERVER_REC *irssi)
+{
+	int count = 0;
+	GList *link;
+	GQueue *servers;
+	struct otr_server_data *data;
+
+	servers = g_hash_table_lookup(server_index, accname);
+	if (!servers) {
+		goto end;
+	}
+
+	g_queue_remove(servers, irssi);
+	if (g_queue_is_empty(servers)) {
+		g_hash_table_remove(server_index, accname);
+		goto end;
+	}
+
+	for (link = servers->head; link; link = link->next) {
+		data = MODULE_DATA((SERVER_REC *) link->data);
+		/* Account names are interned. */
+		if (data && data->accname == accname) {
+			count++;
+		}
+	}
+
+end:
+	return count;
+}
+
+/*
+ * Get the account of a server that just connected ready: loaded in lazy mode
+ * and with an instance tag. The accounts of the servers already connected at
+ * startup are done in one go, their instance tags written at once.
+ */
+static void account_load_job(void *data)
+{
+	if (user_state_global) {
+		key_gen_instag(user_state_global, data, OTR_PROTOCOL_ID);
+	}
+}
+
+/*
+ * Unload the account of the last of its servers. Lazy mode only.
+ */
+static void account_release_job(void *data)
+{
+	if (user_state_global) {
+		otr_user_state_release(user_state_global, data);
+	}
+}
+
+/*
+ * Set the account name of a server record and keep the account name to server
+ * index in sync. The account is loaded with its first server and released,
+ * in lazy mode, with the last one.
+ */
+static void set_account_name(SERVER_REC *irssi, struct otr_server_data *data,
+		const char *accname)
+{
+	const char *old = data->accname;
+	/* Account names are interned. */
+	int changed = old != accname && user_state_global;
+
+	if (old && server_index_remove(old, irssi) == 0 && changed) {
+		otr_post_job(NULL, NULL, account_release_job, (void *) old, NULL);
+	}
+
+	data->accname = accname;
+
+	if (accname && server_index_add(accname, irssi) == 1 && changed) {
+		otr_post_job(NULL, NULL, account_load_job, (void *) accname, NULL);
+	}
+}
+
+/*
+ * Return the cached account name of the Irssi server record. It is computed
+ * only once per nick change so the message path does no formatting nor
+ * allocation to identify the account.
+ *
+ * The worker uses the account name snapshot when its job was posted since the
+ * server record belongs to the main loop.
+ *
+ * Return: nick@myserver.net or NULL on error.
+ */
+static const char *get_account_name(SERVER_REC *irssi)
+{
+	struct otr_server_data *data;
+	const struct worker_job *job;
+
+	assert(irssi);
+
+	job = worker_current_job();
+	if (job && !job->sync) {
+		return job->server == irssi ? job->accname : NULL;
+	}
+
+	data = get_server_data(irssi);
+	if (!data) {
+		return NULL;
 	}
 
-	return accname;
+	if (!data->accname) {
+		set_account_name(irssi, data, build_account_name(irssi));
+	}
+
+	return data->accname;
 }
 
 /*
@@ -114,6 +439,46 @@ error_filename:
 	return;
 }
 
+static guint context_key_hash(gconstpointer data)
+{
+	const struct otr_context_key *key = data;
+
+	return g_str_hash(key->accname) * 31 + g_str_hash(key->nick);
+}
+
+static gboolean context_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct otr_context_key *ka = a, *kb = b;
+
+	return strcmp(ka->nick, kb->nick) == 0 &&
+		strcmp(ka->accname, kb->accname) == 0;
+}
+
+static void context_key_free(gpointer data)
+{
+	struct otr_context_key *key = data;
+
+	free(key->accname);
+	free(key->nick);
+	free(key);
+}
+
+/*
+ * Lookup the master context of the (account name, nick) pair in the index.
+ *
+ * Return the context or NULL if not indexed.
+ */
+static ConnContext *context_index_lookup(const char *accname, const char *nick)
+{
+	struct otr_context_key key;
+
+	/* The key is only read so casting the const away is fine. */
+	key.accname = (char *) accname;
+	key.nick = (char *) nick;
+
+	return g_hash_table_lookup(context_index, &key);
+}
+
 /*
  * Free otr peer context. Callback passed to libotr.
  */
@@ -122,6 +487,15 @@ static void destroy_peer_context_cb(void *data)
 	struct otr_peer_context *opc = data;
 
 	if (opc) {
+		/*
+		 * Libotr has already freed the context strings at this point so the
+		 * index entry is removed with the key we own.
+		 */
+		if (opc->index_key) {
+			status_publish_removed(opc->index_key);
+			g_hash_table_remove(context_index, opc->index_key);
+		}
+		fragment_queue_clear(&opc->fragments);
 		free(opc);
 	}
 
@@ -149,263 +523,2124 @@ static void add_peer_context_cb(void *data, ConnContext *context)
 }
 
 /*
- * Find Irssi server record by account name.
+ * Add a master context to the index. The context gets a peer context if it has
+ * none (e.g. loaded from the fingerprints file) so the destroy callback always
+ * removes it from the index.
  */
-static SERVER_REC *find_irssi_by_account_name(const char *accname)
+static void context_index_add(SERVER_REC *irssi, ConnContext *master)
 {
-	GSList *tmp;
-	size_t nick_len;
-	char *address, *nick = NULL;
-	SERVER_REC *server, *srv = NULL;
+	struct otr_peer_context *opc;
+	struct otr_context_key *key;
 
-	assert(accname);
+	assert(master);
 
-	address = strchr(accname, '@');
-	if (!address) {
-		goto error;
+	if (!master->app_data) {
+		add_peer_context_cb(irssi, master);
 	}
 
-	/* Calculate the nickname length. */
-	nick_len = address - accname;
+	opc = master->app_data;
+	if (!opc || opc->index_key) {
+		/* ENOMEM or already indexed. */
+		goto end;
+	}
 
-	/* Allocate right size for the nickname plus the NULL terminated byte. */
-	nick = malloc(nick_len + 1);
-	if (!nick) {
-		/* ENOMEM */
-		goto error;
+	key = zmalloc(sizeof(*key));
+	if (!key) {
+		goto end;
+	}
+
+	key->accname = strdup(master->accountname);
+	key->nick = strdup(master->username);
+	if (!key->accname || !key->nick) {
+		context_key_free(key);
+		goto end;
 	}
 
-	/* Get the nick from the account name. */
-	strncpy(nick, accname, nick_len);
-	nick[nick_len] = '\0';
+	g_hash_table_replace(context_index, key, master);
+	opc->index_key = key;
+
+end:
+	return;
+}
 
-	/* Move after the @ */
-	address++;
+static guint fp_hash_hash(gconstpointer data)
+{
+	const unsigned char *hash = data;
 
-	for (tmp = servers; tmp; tmp = tmp->next) {
-		server = tmp->data;
-		if (g_ascii_strncasecmp(server->connrec->address, address,
-					strlen(server->connrec->address)) == 0 &&
-				strncmp(server->nick, nick, strlen(nick)) == 0) {
-			srv = server;
-			break;
+	/* SHA-1 output so any four bytes are well distributed. */
+	return (hash[0] << 24) | (hash[1] << 16) | (hash[2] << 8) | hash[3];
+}
+
+static gboolean fp_hash_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, 20) == 0;
+}
+
+/*
+ * Compare the first ndigits hex digits of two hashes.
+ */
+static int fp_prefix_cmp(const unsigned char *a, const unsigned char *b,
+		int ndigits)
+{
+	int ret;
+
+	ret = memcmp(a, b, ndigits / 2);
+	if (ret == 0 && ndigits % 2) {
+		ret = (a[ndigits / 2] >> 4) - (b[ndigits / 2] >> 4);
+	}
+
+	return ret;
+}
+
+/*
+ * Return the position of the first sorted chain head whose hash prefix is
+ * greater or equal to the given one.
+ */
+static size_t fp_sorted_lower_bound(const unsigned char *hash, int ndigits)
+{
+	size_t low = 0, high = fp_sorted_len, mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (fp_prefix_cmp(fp_sorted[mid]->hash, hash, ndigits) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
 		}
 	}
 
-	free(nick);
+	return low;
+}
 
-error:
-	return srv;
+static void fp_entry_free(struct otr_fp_entry *entry)
+{
+	free(entry->accname);
+	free(entry->username);
+	free(entry);
 }
 
 /*
- * Check if fingerprint is in an encrypted context.
- *
- * Return 1 if it does, else 0.
+ * Add a fingerprint to the index. Nothing is done if it is already indexed.
  */
-static int check_fp_encrypted_msgstate(Fingerprint *fp)
+void otr_fp_index_add(const char *accname, const char *username,
+		const unsigned char *hash)
 {
-	int ret;
-	ConnContext *context;
+	size_t pos;
+	struct otr_fp_entry *head, *entry;
 
-	assert(fp);
+	assert(accname);
+	assert(username);
+	assert(hash);
 
-	/* Loop on all fingerprint's context(es). */
-	for (context = fp->context;
-			context != NULL && context->m_context == fp->context;
-			context = context->next) {
-		if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
-				context->active_fingerprint == fp) {
-			ret = 1;
+	head = g_hash_table_lookup(fp_index, hash);
+	for (entry = head; entry; entry = entry->next) {
+		if (strcmp(entry->username, username) == 0 &&
+				strcmp(entry->accname, accname) == 0) {
 			goto end;
 		}
 	}
 
-	/* No state is encrypted. */
-	ret = 0;
+	if (!head && fp_sorted_len == fp_sorted_size) {
+		struct otr_fp_entry **tmp;
+		size_t new_size = fp_sorted_size ? fp_sorted_size * 2 : 64;
+
+		tmp = realloc(fp_sorted, new_size * sizeof(*fp_sorted));
+		if (!tmp) {
+			goto end;
+		}
+		fp_sorted = tmp;
+		fp_sorted_size = new_size;
+	}
+
+	entry = zmalloc(sizeof(*entry));
+	if (!entry) {
+		goto end;
+	}
+	memcpy(entry->hash, hash, sizeof(entry->hash));
+	entry->accname = strdup(accname);
+	entry->username = strdup(username);
+	if (!entry->accname || !entry->username) {
+		fp_entry_free(entry);
+		goto end;
+	}
+
+	if (head) {
+		/* Same key under another context. Chain it after the head. */
+		entry->next = head->next;
+		head->next = entry;
+		goto end;
+	}
+
+	g_hash_table_insert(fp_index, entry->hash, entry);
+
+	pos = fp_sorted_lower_bound(entry->hash, 40);
+	memmove(&fp_sorted[pos + 1], &fp_sorted[pos],
+			(fp_sorted_len - pos) * sizeof(*fp_sorted));
+	fp_sorted[pos] = entry;
+	fp_sorted_len++;
 
 end:
-	return ret;
+	return;
 }
 
 /*
- * Timer called from the glib main loop and set up by the timer_control
- * callback of libotr.
+ * Remove a fingerprint of the given context from the index.
  */
-static gboolean timer_fired_cb(gpointer data)
+static void fp_index_remove(const char *accname, const char *username,
+		const unsigned char *hash)
 {
-	otrl_message_poll(user_state_global->otr_state, &otr_ops, NULL);
-	return TRUE;
-}
+	size_t pos;
+	struct otr_fp_entry *head, *entry, **prev;
 
-void otr_control_timer(unsigned int interval, void *opdata)
-{
-	if (otr_timerid) {
-		g_source_remove(otr_timerid);
+	head = g_hash_table_lookup(fp_index, hash);
+	if (!head) {
+		goto end;
+	}
+
+	for (prev = &head, entry = head; entry;
+			prev = &entry->next, entry = entry->next) {
+		if (strcmp(entry->username, username) == 0 &&
+				strcmp(entry->accname, accname) == 0) {
+			break;
+		}
+	}
+	if (!entry) {
+		goto end;
+	}
+
+	if (entry != head) {
+		*prev = entry->next;
+		fp_entry_free(entry);
+		goto end;
+	}
+
+	/* The head is going away, the next entry takes its slots. */
+	pos = fp_sorted_lower_bound(head->hash, 40);
+	assert(pos < fp_sorted_len && fp_sorted[pos] == head);
+
+	g_hash_table_remove(fp_index, head->hash);
+	if (head->next) {
+		g_hash_table_insert(fp_index, head->next->hash, head->next);
+		fp_sorted[pos] = head->next;
+	} else {
+		memmove(&fp_sorted[pos], &fp_sorted[pos + 1],
+				(fp_sorted_len - pos - 1) * sizeof(*fp_sorted));
+		fp_sorted_len--;
+	}
+	fp_entry_free(head);
+
+end:
+	return;
+}
+
+/*
+ * Empty the fingerprint index.
+ */
+static void fp_index_clear(void)
+{
+	size_t i;
+	struct otr_fp_entry *entry, *next;
+
+	for (i = 0; i < fp_sorted_len; i++) {
+		for (entry = fp_sorted[i]; entry; entry = next) {
+			next = entry->next;
+			fp_entry_free(entry);
+		}
+	}
+
+	if (fp_index) {
+		g_hash_table_remove_all(fp_index);
+	}
+	fp_sorted_len = 0;
+}
+
+/*
+ * Index every fingerprint of the user state. Done once after loading the
+ * fingerprints file.
+ */
+static void fp_index_build(struct otr_user_state *ustate)
+{
+	ConnContext *ctx;
+	Fingerprint *fp;
+
+	for (ctx = ustate->otr_state->context_root; ctx; ctx = ctx->next) {
+		/* Fingerprints are stored in the master context. */
+		if (ctx != ctx->m_context) {
+			continue;
+		}
+
+		for (fp = ctx->fingerprint_root.next; fp; fp = fp->next) {
+			otr_fp_index_add(ctx->accountname, ctx->username, fp->fingerprint);
+		}
+	}
+}
+
+/*
+ * Return the libotr fingerprint object of an index entry or NULL if libotr
+ * does not know it anymore.
+ */
+static Fingerprint *fp_entry_resolve(struct otr_fp_entry *entry,
+		struct otr_user_state *ustate)
+{
+	ConnContext *ctx;
+
+	ctx = context_index_lookup(entry->accname, entry->username);
+	if (!ctx) {
+		ustate = otr_user_state_shard(ustate, entry->accname);
+		if (!ustate) {
+			return NULL;
+		}
+		ctx = otrl_context_find(ustate->otr_state, entry->username,
+				entry->accname, OTR_PROTOCOL_ID, OTRL_INSTAG_MASTER, 0, NULL,
+				NULL, NULL);
+		if (!ctx) {
+			return NULL;
+		}
+		context_index_add(NULL, ctx);
+	}
+
+	return otrl_context_find_fingerprint(ctx, entry->hash, 0, NULL);
+}
+
+/*
+ * Find Irssi server record by account name.
+ */
+static SERVER_REC *find_irssi_by_account_name(const char *accname)
+{
+	GQueue *servers;
+
+	assert(accname);
+
+	servers = g_hash_table_lookup(server_index, accname);
+	return servers ? g_queue_peek_head(servers) : NULL;
+}
+
+/*
+ * Check if fingerprint is in an encrypted context.
+ *
+ * Return 1 if it does, else 0.
+ */
+static int check_fp_encrypted_msgstate(Fingerprint *fp)
+{
+	int ret;
+	ConnContext *context;
+
+	assert(fp);
+
+	/* Loop on all fingerprint's context(es). */
+	for (context = fp->context;
+			context != NULL && context->m_context == fp->context;
+			context = context->next) {
+		if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
+				context->active_fingerprint == fp) {
+			ret = 1;
+			goto end;
+		}
+	}
+
+	/* No state is encrypted. */
+	ret = 0;
+
+end:
+	return ret;
+}
+
+/*
+ * Apply a fingerprint change found on disk: add the fingerprint or set its
+ * trust, "" being none, or forget it if trust is NULL. A fingerprint in use by
+ * an encrypted session is not forgotten.
+ */
+void otr_fp_apply(struct otr_user_state *ustate, const char *username,
+		const char *accname, const char *protocol, const unsigned char *hash,
+		const char *trust)
+{
+	int added = 0;
+	ConnContext *ctx;
+	Fingerprint *fp;
+
+	assert(ustate);
+	assert(username);
+	assert(accname);
+	assert(protocol);
+	assert(hash);
+
+	ustate = otr_user_state_shard(ustate, accname);
+	if (!ustate) {
+		goto end;
+	}
+
+	/* Fingerprints are always attached to the master context. */
+	ctx = otrl_context_find(ustate->otr_state, username, accname, protocol,
+			OTRL_INSTAG_MASTER, trust != NULL, NULL, NULL, NULL);
+	if (!ctx) {
+		goto end;
+	}
+
+	fp = otrl_context_find_fingerprint(ctx, (unsigned char *) hash,
+			trust != NULL, &added);
+	if (!fp) {
+		goto end;
+	}
+
+	if (trust) {
+		otrl_context_set_trust(fp, trust[0] ? trust : NULL);
+		if (added) {
+			otr_fp_index_add(accname, username, hash);
+		}
+	} else if (!check_fp_encrypted_msgstate(fp)) {
+		fp_index_remove(accname, username, hash);
+		otrl_context_forget_fingerprint(fp, 1);
+	}
+
+end:
+	return;
+}
+
+/*
+ * Set the timer interval to the shortest one asked by a libotr state, 0 if
+ * none has keys to expire so an idle client is not woken up.
+ */
+static void timer_interval_update(void)
+{
+	unsigned int interval = 0;
+	GList *states, *tmp;
+	struct otr_user_state *ustate;
+
+	states = otr_user_state_list(user_state_global);
+	for (tmp = states; tmp; tmp = tmp->next) {
+		ustate = tmp->data;
+		if (ustate->poll_interval &&
+				(!interval || ustate->poll_interval < interval)) {
+			interval = ustate->poll_interval;
+		}
+	}
+	g_list_free(states);
+
+	otr_timer_interval = interval;
+}
+
+/*
+ * Timer job run by the worker. Polls the libotr states waiting for it, with
+ * the number of contexts visited and the time taken in debug mode, and
+ * expires the pending fragment buffers.
+ */
+static void timer_job(void *data)
+{
+	int polled = 0;
+	unsigned int contexts = 0;
+	gint64 start;
+	GList *states, *tmp;
+	ConnContext *ctx;
+	struct otr_user_state *ustate;
+
+	if (otr_timer_interval && user_state_global) {
+		start = g_get_monotonic_time();
+
+		/* Only the states with keys to expire, libotr walks every context. */
+		states = otr_user_state_list(user_state_global);
+		for (tmp = states; tmp; tmp = tmp->next) {
+			ustate = tmp->data;
+			if (!ustate->poll_interval) {
+				continue;
+			}
+
+			for (ctx = ustate->otr_state->context_root; ctx; ctx = ctx->next) {
+				contexts++;
+			}
+
+			otr_poll_state = ustate;
+			otrl_message_poll(ustate->otr_state, &otr_ops, NULL);
+			otr_poll_state = NULL;
+			polled++;
+		}
+		g_list_free(states);
+
+		IRSSI_DEBUG("Poll of %d states, %u contexts in %d us", polled,
+				contexts, (int) (g_get_monotonic_time() - start));
+
+		/* A released shard might have been waiting for it. */
+		timer_interval_update();
+	}
+
+	fragment_expire();
+	otr_timer_update();
+}
+
+static void timer_job_done(void *data)
+{
+	otr_timer_job_pending = 0;
+}
+
+/*
+ * Timer called from the glib main loop and set up by the timer_control
+ * callback of libotr. A busy worker does not pile up timer jobs.
+ */
+static gboolean timer_fired_cb(gpointer data)
+{
+	if (!otr_timer_job_pending) {
+		otr_timer_job_pending = 1;
+		otr_post_job(NULL, NULL, timer_job, NULL, timer_job_done);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Arm the glib timer with the given interval. Main loop only.
+ */
+static void timer_arm(unsigned int interval)
+{
+	if (otr_timerid && interval == otr_timer_armed) {
+		return;
+	}
+
+	if (otr_timerid) {
+		g_source_remove(otr_timerid);
+		otr_timerid = 0;
+	}
+
+	otr_timer_armed = interval;
+	if (interval > 0) {
+		otr_timerid = g_timeout_add_seconds(interval, timer_fired_cb, NULL);
+	}
+}
+
+static void timer_arm_cb(void *data)
+{
+	timer_arm(GPOINTER_TO_UINT(data));
+}
+
+/*
+ * Arm the glib timer with the shortest interval needed by libotr and by the
+ * fragment expiry, if any. The worker only tells the main loop when the
+ * interval changes.
+ */
+void otr_timer_update(void)
+{
+	unsigned int interval = otr_timer_interval;
+
+	if (fragment_mem_usage() > 0 && (!interval ||
+				interval > OTR_FRAGMENT_TIMER_INTERVAL)) {
+		interval = OTR_FRAGMENT_TIMER_INTERVAL;
+	}
+
+	if (!worker_in_thread()) {
+		timer_arm(interval);
+		return;
+	}
+
+	if (interval == otr_timer_requested) {
+		return;
+	}
+
+	otr_timer_requested = interval;
+	worker_defer(timer_arm_cb, GUINT_TO_POINTER(interval), NULL);
+}
+
+/*
+ * Set the poll interval of the libotr state libotr is talking about: the one
+ * being polled or else the one of the account of the server record. Without
+ * either, the interval applies to every state.
+ */
+void otr_control_timer(unsigned int interval, void *opdata)
+{
+	const char *accname;
+	GList *states, *tmp;
+	struct otr_user_state *ustate = otr_poll_state;
+
+	if (!ustate && opdata && user_state_global) {
+		accname = get_account_name(opdata);
+		if (accname) {
+			ustate = otr_user_state_shard(user_state_global, accname);
+		}
+	}
+
+	if (ustate) {
+		ustate->poll_interval = interval;
+	} else if (user_state_global) {
+		states = otr_user_state_list(user_state_global);
+		for (tmp = states; tmp; tmp = tmp->next) {
+			((struct otr_user_state *) tmp->data)->poll_interval = interval;
+		}
+		g_list_free(states);
+	}
+
+	if (user_state_global) {
+		timer_interval_update();
+	} else {
+		otr_timer_interval = interval;
+	}
+	otr_timer_update();
+}
+
+/*
+ * Return the libotr state of an account or NULL on error.
+ */
+static OtrlUserState get_otr_state(const char *accname)
+{
+	struct otr_user_state *ustate;
+
+	ustate = otr_user_state_shard(user_state_global, accname);
+	if (!ustate) {
+		return NULL;
+	}
+
+	return ustate->otr_state;
+}
+
+/*
+ * Find context from nickname and irssi server record.
+ */
+ConnContext *otr_find_context(SERVER_REC *irssi, const char *nick, int create)
+{
+	const char *accname;
+	ConnContext *ctx = NULL;
+	OtrlUserState us;
+
+	assert(irssi);
+	assert(nick);
+
+	accname = get_account_name(irssi);
+	if (!accname) {
+		goto error;
+	}
+
+	ctx = context_index_lookup(accname, nick);
+	if (!ctx) {
+		us = get_otr_state(accname);
+		if (!us) {
+			goto error;
+		}
+
+		/* Miss. Walk the libotr list once and index the master context. */
+		ctx = otrl_context_find(us, nick, accname, OTR_PROTOCOL_ID,
+				OTRL_INSTAG_MASTER, create, NULL, add_peer_context_cb, irssi);
+		if (!ctx) {
+			goto error;
+		}
+		context_index_add(irssi, ctx);
+	}
+
+	/* Same as OTRL_INSTAG_BEST for otrl_context_find(). */
+	ctx = otrl_context_find_recent_secure_instance(ctx);
+
+error:
+	return ctx;
+}
+
+/*
+ * Refresh the cached account name of a server record. Called when the server
+ * connects and each time our nick changes on it.
+ */
+void otr_server_update(SERVER_REC *irssi)
+{
+	struct otr_server_data *data;
+
+	assert(irssi);
+
+	data = get_server_data(irssi);
+	if (!data) {
+		return;
+	}
+
+	set_account_name(irssi, data, build_account_name(irssi));
+}
+
+/*
+ * Send the messages held by the flood control of a server record right away,
+ * unless it is already disconnected.
+ */
+void otr_server_flush(SERVER_REC *irssi)
+{
+	struct otr_server_data *data;
+
+	assert(irssi);
+
+	data = MODULE_DATA(irssi);
+	if (!data || irssi->disconnected) {
+		return;
+	}
+
+	sched_flush(data->sched);
+}
+
+/*
+ * Release the module data of a server record.
+ */
+void otr_server_free(SERVER_REC *irssi)
+{
+	struct otr_server_data *data;
+
+	assert(irssi);
+
+	data = MODULE_DATA(irssi);
+	if (!data) {
+		return;
+	}
+
+	/* Messages such as OTR disconnects must still go out on unload. */
+	otr_server_flush(irssi);
+
+	set_account_name(irssi, data, NULL);
+	sched_free(data->sched);
+
+	MODULE_DATA_UNSET(irssi);
+	free(data);
+}
+
+/*
+ * Create otr peer context.
+ */
+struct otr_peer_context *otr_create_peer_context(void)
+{
+	return zmalloc(sizeof(struct otr_peer_context));
+}
+
+/*
+ * Load the instance tags, keys and fingerprints files in a user state.
+ */
+static void user_state_load(struct otr_user_state *ustate)
+{
+	instag_load(ustate);
+
+	/* Load keys and fingerprints. */
+	key_load(ustate);
+	key_load_fingerprints(ustate);
+}
+
+/*
+ * Drop from a shard what belongs to other accounts. The files hold every
+ * account so this is done after loading them in a shard.
+ */
+void otr_user_state_prune(struct otr_user_state *shard)
+{
+	GSList *masters = NULL, *tmp;
+	ConnContext *ctx;
+	OtrlPrivKey *key, *next_key;
+	OtrlInsTag *instag, *next_instag;
+	OtrlUserState us;
+
+	assert(shard);
+	assert(shard->accname);
+
+	us = shard->otr_state;
+
+	for (key = us->privkey_root; key; key = next_key) {
+		next_key = key->next;
+		if (strcmp(key->accountname, shard->accname) != 0) {
+			otrl_privkey_forget(key);
+		}
+	}
+
+	for (instag = us->instag_root; instag; instag = next_instag) {
+		next_instag = instag->next;
+		if (strcmp(instag->accountname, shard->accname) != 0) {
+			otrl_instag_forget(instag);
+		}
+	}
+
+	/* Forgetting a master context forgets its children so collect first. */
+	for (ctx = us->context_root; ctx; ctx = ctx->next) {
+		if (ctx == ctx->m_context &&
+				strcmp(ctx->accountname, shard->accname) != 0) {
+			masters = g_slist_prepend(masters, ctx);
+		}
+	}
+	for (tmp = masters; tmp; tmp = tmp->next) {
+		otrl_context_forget(tmp->data);
+	}
+	g_slist_free(masters);
+}
+
+static void shard_free(gpointer data)
+{
+	struct otr_user_state *shard = data;
+
+	otrl_userstate_free(shard->otr_state);
+	free(shard);
+}
+
+/*
+ * otr.fp and otr.instag lines and otr.key S-expressions of an account not
+ * loaded.
+ */
+struct otr_dormant {
+	GString *lines[3];
+};
+
+static void dormant_free(gpointer data)
+{
+	struct otr_dormant *dormant = data;
+
+	g_string_free(dormant->lines[OTR_DORMANT_FINGERPRINTS], TRUE);
+	g_string_free(dormant->lines[OTR_DORMANT_INSTAGS], TRUE);
+	g_string_free(dormant->lines[OTR_DORMANT_KEYS], TRUE);
+	free(dormant);
+}
+
+/*
+ * Return the dormant lines of an account, created if needed.
+ */
+static struct otr_dormant *dormant_get(struct otr_user_state *root,
+		const char *accname)
+{
+	struct otr_dormant *dormant;
+
+	dormant = g_hash_table_lookup(root->dormant, accname);
+	if (dormant) {
+		goto end;
+	}
+
+	dormant = zmalloc(sizeof(*dormant));
+	if (!dormant) {
+		goto end;
+	}
+	dormant->lines[OTR_DORMANT_FINGERPRINTS] = g_string_new(NULL);
+	dormant->lines[OTR_DORMANT_INSTAGS] = g_string_new(NULL);
+	dormant->lines[OTR_DORMANT_KEYS] = g_string_new(NULL);
+	g_hash_table_insert(root->dormant, (gpointer) g_intern_string(accname),
+			dormant);
+
+end:
+	return dormant;
+}
+
+/*
+ * Write a libotr file of the given state in memory and move its lines to the
+ * dormant lines of their account. The account name is the second field of an
+ * otr.fp line and the first one of an otr.instag line.
+ */
+static gcry_error_t dormant_capture(struct otr_user_state *root,
+		OtrlUserState us, enum otr_dormant_file file)
+{
+	int field;
+	char *buf = NULL, *line, *eol, *accname, *tab;
+	size_t size = 0;
+	FILE *fp;
+	gcry_error_t err;
+	struct otr_dormant *dormant;
+
+	fp = open_memstream(&buf, &size);
+	if (!fp) {
+		return gcry_error_from_errno(errno);
+	}
+
+	if (file == OTR_DORMANT_FINGERPRINTS) {
+		err = otrl_privkey_write_fingerprints_FILEp(us, fp);
+		field = 1;
+	} else {
+		err = otrl_instag_write_FILEp(us, fp);
+		field = 0;
+	}
+	fclose(fp);
+	if (err != GPG_ERR_NO_ERROR) {
+		goto end;
+	}
+
+	for (line = buf; line < buf + size; line = eol + 1) {
+		eol = memchr(line, '\n', buf + size - line);
+		if (!eol) {
+			break;
+		}
+
+		accname = line;
+		if (field == 1) {
+			accname = memchr(line, '\t', eol - line);
+			if (!accname) {
+				continue;
+			}
+			accname++;
+		}
+		tab = memchr(accname, '\t', eol - accname);
+		if (!tab) {
+			continue;
+		}
+
+		*tab = '\0';
+		dormant = dormant_get(root, accname);
+		*tab = '\t';
+		if (!dormant) {
+			err = gcry_error(GPG_ERR_ENOMEM);
+			goto end;
+		}
+		g_string_append_len(dormant->lines[file], line, eol - line + 1);
+	}
+
+end:
+	free(buf);
+	return err;
+}
+
+/*
+ * Move the private keys of the given state to the dormant keys of their
+ * account so loading it does not parse otr.key again.
+ */
+static gcry_error_t dormant_capture_keys(struct otr_user_state *root,
+		OtrlUserState us)
+{
+	char *buf;
+	size_t size;
+	FILE *fp;
+	gcry_error_t err = GPG_ERR_NO_ERROR;
+	OtrlPrivKey *pk;
+	struct otr_dormant *dormant;
+
+	for (pk = us->privkey_root; pk && err == GPG_ERR_NO_ERROR; pk = pk->next) {
+		dormant = dormant_get(root, pk->accountname);
+		if (!dormant) {
+			err = gcry_error(GPG_ERR_ENOMEM);
+			break;
+		}
+
+		buf = NULL;
+		size = 0;
+		fp = open_memstream(&buf, &size);
+		if (!fp) {
+			err = gcry_error_from_errno(errno);
+			break;
+		}
+		err = key_write_privkey(fp, pk);
+		fclose(fp);
+
+		if (err == GPG_ERR_NO_ERROR) {
+			g_string_append_len(dormant->lines[OTR_DORMANT_KEYS], buf, size);
+		}
+		free(buf);
+	}
+
+	return err;
+}
+
+/*
+ * Read the dormant lines of an account back in its shard.
+ */
+static void dormant_restore(struct otr_user_state *shard,
+		struct otr_dormant *dormant)
+{
+	FILE *fp;
+	GString *lines;
+
+	lines = dormant->lines[OTR_DORMANT_INSTAGS];
+	if (lines->len > 0) {
+		fp = fmemopen(lines->str, lines->len, "r");
+		if (fp) {
+			otrl_instag_read_FILEp(shard->otr_state, fp);
+			fclose(fp);
+		}
+	}
+
+	lines = dormant->lines[OTR_DORMANT_FINGERPRINTS];
+	if (lines->len > 0) {
+		fp = fmemopen(lines->str, lines->len, "r");
+		if (fp) {
+			otrl_privkey_read_fingerprints_FILEp(shard->otr_state, fp, NULL,
+					NULL);
+			fclose(fp);
+		}
+	}
+}
+
+/*
+ * Write the dormant lines of every account not loaded to fp. Nothing is
+ * written if not in lazy mode.
+ */
+gcry_error_t otr_user_state_write_dormant(struct otr_user_state *ustate,
+		enum otr_dormant_file file, FILE *fp)
+{
+	GHashTableIter iter;
+	gpointer value;
+	GString *lines;
+
+	assert(ustate);
+	assert(fp);
+
+	if (ustate->root) {
+		ustate = ustate->root;
+	}
+
+	if (!ustate->dormant) {
+		goto end;
+	}
+
+	g_hash_table_iter_init(&iter, ustate->dormant);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		lines = ((struct otr_dormant *) value)->lines[file];
+		if (fwrite(lines->str, 1, lines->len, fp) != lines->len) {
+			return gcry_error_from_errno(errno);
+		}
+	}
+
+end:
+	return GPG_ERR_NO_ERROR;
+}
+
+/*
+ * Create the shard of an account in the global state. In lazy mode, the
+ * account is loaded from its dormant lines and keys.
+ */
+static struct otr_user_state *shard_new(struct otr_user_state *root,
+		const char *accname)
+{
+	struct otr_user_state *shard;
+
+	shard = zmalloc(sizeof(*shard));
+	if (!shard) {
+		goto error;
+	}
+
+	shard->otr_state = otrl_userstate_create();
+	if (!shard->otr_state) {
+		free(shard);
+		shard = NULL;
+		goto error;
+	}
+	shard->accname = g_intern_string(accname);
+	shard->root = root;
+
+	if (root->dormant) {
+		struct otr_dormant *dormant;
+
+		/* The fingerprints of the account are already indexed. */
+		dormant = g_hash_table_lookup(root->dormant, accname);
+		key_load_account(shard, dormant ?
+				dormant->lines[OTR_DORMANT_KEYS] : NULL);
+		if (dormant) {
+			dormant_restore(shard, dormant);
+			g_hash_table_remove(root->dormant, accname);
+		}
+		otr_user_state_prune(shard);
+	}
+
+	g_hash_table_insert(root->shards, (gpointer) shard->accname, shard);
+
+	IRSSI_DEBUG("User state shard created for %9%s%9", accname);
+
+error:
+	return shard;
+}
+
+/*
+ * Where the next key, instance tag and context of a shard are appended so
+ * the order of the files is kept.
+ */
+struct shard_tails {
+	OtrlPrivKey **key;
+	OtrlInsTag **instag;
+	ConnContext **ctx;
+};
+
+/*
+ * Return the tails of the shard of an account, created if needed, or NULL on
+ * error.
+ */
+static struct shard_tails *shard_tails_get(struct otr_user_state *root,
+		GHashTable *tails, const char *accname)
+{
+	struct otr_user_state *shard;
+	struct shard_tails *tail;
+
+	shard = g_hash_table_lookup(root->shards, accname);
+	if (!shard) {
+		shard = shard_new(root, accname);
+		if (!shard) {
+			return NULL;
+		}
+	}
+
+	tail = g_hash_table_lookup(tails, shard->accname);
+	if (!tail) {
+		tail = zmalloc(sizeof(*tail));
+		if (!tail) {
+			return NULL;
+		}
+		tail->key = &shard->otr_state->privkey_root;
+		tail->instag = &shard->otr_state->instag_root;
+		tail->ctx = &shard->otr_state->context_root;
+		g_hash_table_insert(tails, (gpointer) shard->accname, tail);
+	}
+
+	return tail;
+}
+
+/*
+ * Move the keys, instance tags and contexts of a state loaded from the files
+ * to the shards of their accounts. The objects are unlinked the way libotr
+ * forgets them and appended to the shard. What can't be moved stays in us.
+ */
+static void shards_split(struct otr_user_state *root, OtrlUserState us)
+{
+	GHashTable *tails;
+	ConnContext *ctx, *next_ctx;
+	OtrlPrivKey *key, *next_key;
+	OtrlInsTag *instag, *next_instag;
+	struct shard_tails *tail;
+
+	tails = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+
+	for (key = us->privkey_root; key; key = next_key) {
+		next_key = key->next;
+		tail = shard_tails_get(root, tails, key->accountname);
+		if (!tail) {
+			continue;
+		}
+		if (key->next) {
+			key->next->tous = key->tous;
+		}
+		*key->tous = key->next;
+		key->next = NULL;
+		key->tous = tail->key;
+		*tail->key = key;
+		tail->key = &key->next;
+	}
+
+	for (instag = us->instag_root; instag; instag = next_instag) {
+		next_instag = instag->next;
+		tail = shard_tails_get(root, tails, instag->accountname);
+		if (!tail) {
+			continue;
+		}
+		if (instag->next) {
+			instag->next->tous = instag->tous;
+		}
+		*instag->tous = instag->next;
+		instag->next = NULL;
+		instag->tous = tail->instag;
+		*tail->instag = instag;
+		tail->instag = &instag->next;
+	}
+
+	/* Children follow their master, both having the same account. */
+	for (ctx = us->context_root; ctx; ctx = next_ctx) {
+		next_ctx = ctx->next;
+		tail = shard_tails_get(root, tails, ctx->accountname);
+		if (!tail) {
+			continue;
+		}
+		if (ctx->next) {
+			ctx->next->tous = ctx->tous;
+		}
+		*ctx->tous = ctx->next;
+		ctx->next = NULL;
+		ctx->tous = tail->ctx;
+		*tail->ctx = ctx;
+		tail->ctx = &ctx->next;
+	}
+
+	g_hash_table_destroy(tails);
+}
+
+/*
+ * Create a shard for each account found in the files. Every account must
+ * have its shard since the files are written back from the shards. The files
+ * are parsed once and split between the shards.
+ *
+ * In lazy mode, no shard is created: the fingerprints are indexed and the
+ * lines of each account are kept as text instead.
+ */
+static void shards_load(struct otr_user_state *root)
+{
+	struct otr_user_state scratch;
+
+	memset(&scratch, 0, sizeof(scratch));
+	scratch.otr_state = otrl_userstate_create();
+	user_state_load(&scratch);
+	fp_index_build(&scratch);
+
+	if (root->dormant) {
+		/*
+		 * Keep the lines of each account until one of its servers connects.
+		 */
+		if (dormant_capture(root, scratch.otr_state,
+					OTR_DORMANT_FINGERPRINTS) == GPG_ERR_NO_ERROR &&
+				dormant_capture(root, scratch.otr_state,
+					OTR_DORMANT_INSTAGS) == GPG_ERR_NO_ERROR &&
+				dormant_capture_keys(root, scratch.otr_state) ==
+					GPG_ERR_NO_ERROR) {
+			goto end;
+		}
+		IRSSI_DEBUG("Error indexing the files, loading every account");
+		g_hash_table_destroy(root->dormant);
+		root->dormant = NULL;
+	}
+
+	shards_split(root, scratch.otr_state);
+
+end:
+	otrl_userstate_free(scratch.otr_state);
+}
+
+/*
+ * Return a newly allocated and empty OTR user state. With the
+ * otr_shard_accounts or otr_lazy_accounts setting, it is split in one shard
+ * per account. The files are loaded by otr_load_user_state().
+ */
+struct otr_user_state *otr_init_user_state(void)
+{
+	struct otr_user_state *ous = NULL;
+
+	ous = zmalloc(sizeof(*ous));
+	if (!ous) {
+		goto error;
+	}
+
+	if (settings_get_bool(OTR_SET_LAZY_ACCOUNTS)) {
+		ous->dormant = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				dormant_free);
+	}
+
+	if (ous->dormant || settings_get_bool(OTR_SET_SHARD_ACCOUNTS)) {
+		ous->shards = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				shard_free);
+	} else {
+		ous->otr_state = otrl_userstate_create();
+	}
+
+	/* The journal only knows about the loaded accounts. */
+	ous->fp_journal = !ous->dormant && settings_get_bool(OTR_SET_FP_JOURNAL);
+
+error:
+	return ous;
+}
+
+/*
+ * Load the instance tags, keys and fingerprints files in the user state.
+ *
+ * Run as the first job of the worker so Irssi starts without waiting for the
+ * files. Messages arriving meanwhile are queued behind it.
+ */
+void otr_load_user_state(struct otr_user_state *ustate)
+{
+	int lock;
+	gint64 start;
+
+	assert(ustate);
+
+	start = g_get_monotonic_time();
+
+	/* Other instances might write the files meanwhile. */
+	lock = key_lock(LOCK_EX);
+
+	if (ustate->shards) {
+		shards_load(ustate);
+	} else {
+		user_state_load(ustate);
+		fp_index_build(ustate);
+	}
+
+	key_fp_store_start(ustate);
+	key_merge_start();
+	key_unlock(lock);
+
+	IRSSI_DEBUG("User state loaded in %d ms",
+			(int) ((g_get_monotonic_time() - start) / 1000));
+}
+
+/*
+ * Return the user state holding the given account: the shard of the account,
+ * created if needed, or the global state itself if not sharded.
+ *
+ * Return NULL on error.
+ */
+struct otr_user_state *otr_user_state_shard(struct otr_user_state *ustate,
+		const char *accname)
+{
+	struct otr_user_state *shard;
+
+	assert(ustate);
+	assert(accname);
+
+	if (ustate->root) {
+		ustate = ustate->root;
+	}
+
+	if (!ustate->shards) {
+		return ustate;
+	}
+
+	shard = g_hash_table_lookup(ustate->shards, accname);
+	if (!shard) {
+		/* Not in the files so nothing to load, unless in lazy mode. */
+		shard = shard_new(ustate, accname);
+	}
+
+	return shard;
+}
+
+/*
+ * Unload the shard of an account in lazy mode. Its fingerprints, instance
+ * tags and keys are kept as text so they are written back with the files and
+ * loaded again by otr_user_state_shard(). Done when the last server of the account
+ * disconnects, the sessions are gone with it.
+ */
+void otr_user_state_release(struct otr_user_state *ustate,
+		const char *accname)
+{
+	struct otr_user_state *shard;
+
+	assert(ustate);
+	assert(accname);
+
+	if (ustate->root) {
+		ustate = ustate->root;
+	}
+
+	if (!ustate->dormant) {
+		goto end;
+	}
+
+	shard = g_hash_table_lookup(ustate->shards, accname);
+	if (!shard) {
+		goto end;
+	}
+
+	if (dormant_capture(ustate, shard->otr_state,
+				OTR_DORMANT_FINGERPRINTS) != GPG_ERR_NO_ERROR ||
+			dormant_capture(ustate, shard->otr_state,
+				OTR_DORMANT_INSTAGS) != GPG_ERR_NO_ERROR ||
+			dormant_capture_keys(ustate, shard->otr_state) !=
+				GPG_ERR_NO_ERROR) {
+		/* Keep it loaded rather than losing fingerprints. */
+		g_hash_table_remove(ustate->dormant, accname);
+		IRSSI_DEBUG("Error releasing the account %9%s%9", accname);
+		goto end;
+	}
+
+	g_hash_table_remove(ustate->shards, accname);
+
+	IRSSI_DEBUG("User state shard released for %9%s%9", accname);
+
+end:
+	return;
+}
+
+/*
+ * Return the list of user states holding the contexts: the shards of the
+ * global state or else the state itself. Free it with g_list_free().
+ */
+GList *otr_user_state_list(struct otr_user_state *ustate)
+{
+	assert(ustate);
+
+	if (ustate->root) {
+		ustate = ustate->root;
+	}
+
+	if (!ustate->shards) {
+		return g_list_prepend(NULL, ustate);
+	}
+
+	return g_hash_table_get_values(ustate->shards);
+}
+
+/*
+ * Destroy otr user state.
+ */
+void otr_free_user_state(struct otr_user_state *ustate)
+{
+	if (ustate->otr_state) {
+		otrl_userstate_free(ustate->otr_state);
+		ustate->otr_state = NULL;
+	}
+
+	if (ustate->shards) {
+		g_hash_table_destroy(ustate->shards);
+		ustate->shards = NULL;
+	}
+
+	if (ustate->dormant) {
+		g_hash_table_destroy(ustate->dormant);
+		ustate->dormant = NULL;
+	}
+
+	free(ustate);
+}
+
+static void status_pending_free(struct otr_status_pending *pending)
+{
+	if (pending->irssi) {
+		server_unref(pending->irssi);
+	}
+	free(pending->nick);
+	free(pending);
+}
+
+/*
+ * Idle callback redrawing the statusbar and emitting the queued events.
+ */
+static gboolean status_flush_cb(gpointer data)
+{
+	GSList *list, *tmp;
+	struct otr_status_pending *pending;
+
+	list = g_slist_reverse(status_pending);
+	status_pending = NULL;
+	status_flush_source = 0;
+
+	statusbar_items_redraw("otr");
+
+	for (tmp = list; tmp; tmp = tmp->next) {
+		pending = tmp->data;
+		signal_emit("otr event", 3, pending->irssi, pending->nick,
+				statusbar_txt[pending->event]);
+		status_pending_free(pending);
+	}
+	g_slist_free(list);
+
+	return FALSE;
+}
+
+static void status_schedule_flush(void)
+{
+	if (!status_flush_source) {
+		status_flush_source = g_idle_add(status_flush_cb, NULL);
+	}
+}
+
+/*
+ * Queue an event unless the same one is already waiting.
+ */
+static void status_queue_event(SERVER_REC *irssi, const char *nick,
+		enum otr_status_event event)
+{
+	GSList *tmp;
+	struct otr_status_pending *pending;
+
+	for (tmp = status_pending; tmp; tmp = tmp->next) {
+		pending = tmp->data;
+		if (pending->irssi == irssi && pending->event == event &&
+				g_strcmp0(pending->nick, nick) == 0) {
+			goto end;
+		}
+	}
+
+	pending = zmalloc(sizeof(*pending));
+	if (!pending) {
+		goto end;
+	}
+
+	if (nick) {
+		pending->nick = strdup(nick);
+		if (!pending->nick) {
+			free(pending);
+			goto end;
+		}
+	}
+
+	/* The server must survive until the flush. */
+	if (irssi) {
+		server_ref(irssi);
+	}
+	pending->irssi = irssi;
+	pending->event = event;
+
+	status_pending = g_slist_prepend(status_pending, pending);
+
+end:
+	status_schedule_flush();
+}
+
+/*
+ * Drop the status changes not flushed yet.
+ */
+static void status_pending_clear(void)
+{
+	if (status_flush_source) {
+		g_source_remove(status_flush_source);
+		status_flush_source = 0;
+	}
+
+	g_slist_free_full(status_pending, (GDestroyNotify) status_pending_free);
+	status_pending = NULL;
+}
+
+static void status_flush_call(void *data)
+{
+	status_schedule_flush();
+}
+
+/*
+ * Request a statusbar redraw on the next main loop iteration.
+ */
+void otr_status_redraw(void)
+{
+	worker_defer(status_flush_call, NULL, NULL);
+}
+
+static void status_entry_free(struct otr_status_entry *entry)
+{
+	free(entry->key.accname);
+	free(entry->key.nick);
+	free(entry);
+}
+
+static void status_publish_free(void *data)
+{
+	struct otr_status_publish *publish = data;
+
+	g_slist_free_full(publish->entries, (GDestroyNotify) status_entry_free);
+	free(publish->nick);
+	free(publish);
+}
+
+/*
+ * Apply the formats published by the worker to the status mirror and queue
+ * the event. Runs in the main loop while the job still holds the server.
+ */
+static void status_publish_cb(void *data)
+{
+	GSList *tmp;
+	struct otr_context_key *key;
+	struct otr_status_entry *entry;
+	struct otr_status_publish *publish = data;
+
+	for (tmp = publish->entries; tmp; tmp = tmp->next) {
+		entry = tmp->data;
+
+		if (entry->removed) {
+			g_hash_table_remove(status_mirror, &entry->key);
+			continue;
+		}
+
+		key = zmalloc(sizeof(*key));
+		if (!key) {
+			continue;
+		}
+		/* Hand the strings over to the mirror. */
+		*key = entry->key;
+		entry->key.accname = entry->key.nick = NULL;
+
+		g_hash_table_replace(status_mirror, key,
+				GINT_TO_POINTER(entry->format));
+	}
+
+	if (publish->event >= 0) {
+		status_queue_event(publish->irssi, publish->nick, publish->event);
+	} else {
+		status_schedule_flush();
+	}
+}
+
+/*
+ * init otr lib.
+ */
+void otr_lib_init()
+{
+	OTRL_INIT;
+
+	context_index = g_hash_table_new_full(context_key_hash, context_key_equal,
+			context_key_free, NULL);
+	status_mirror = g_hash_table_new_full(context_key_hash, context_key_equal,
+			context_key_free, NULL);
+	fp_index = g_hash_table_new(fp_hash_hash, fp_hash_equal);
+	server_index = g_hash_table_new_full(account_name_hash, account_name_equal,
+			NULL, (GDestroyNotify) g_queue_free);
+	network_sizes = g_hash_table_new_full(account_name_hash,
+			account_name_equal, g_free, free);
+	otr_load_msg_size_networks();
+}
+
+/*
+ * deinit otr lib.
+ */
+void otr_lib_uninit()
+{
+	status_pending_clear();
+
+	/* Pending fragments could have kept the timer armed. */
+	if (otr_timerid) {
+		g_source_remove(otr_timerid);
 		otr_timerid = 0;
 	}
 
-	if (interval > 0) {
-		otr_timerid = g_timeout_add_seconds(interval, timer_fired_cb, opdata);
-	}
+	if (context_index) {
+		g_hash_table_destroy(context_index);
+		context_index = NULL;
+	}
+
+	if (status_mirror) {
+		g_hash_table_destroy(status_mirror);
+		status_mirror = NULL;
+	}
+
+	fp_index_clear();
+	if (fp_index) {
+		g_hash_table_destroy(fp_index);
+		fp_index = NULL;
+	}
+	free(fp_sorted);
+	fp_sorted = NULL;
+	fp_sorted_size = 0;
+
+	if (network_sizes) {
+		g_hash_table_destroy(network_sizes);
+		network_sizes = NULL;
+	}
+
+	if (server_index) {
+		g_hash_table_destroy(server_index);
+		server_index = NULL;
+	}
+}
+
+/*
+ * Hand the given message to OTR.
+ *
+ * Return 0 if the message was successfully handled or else a negative value.
+ */
+int otr_send(SERVER_REC *irssi, const char *msg, const char *to, char **otr_msg)
+{
+	gcry_error_t err;
+	const char *accname;
+	ConnContext *ctx = NULL;
+	OtrlUserState us;
+
+	assert(irssi);
+
+	accname = get_account_name(irssi);
+	if (!accname) {
+		goto error;
+	}
+
+	us = get_otr_state(accname);
+	if (!us) {
+		goto error;
+	}
+
+	IRSSI_DEBUG("Sending message...");
+
+	otr_sending = 1;
+	err = otrl_message_sending(us, &otr_ops,
+		irssi, accname, OTR_PROTOCOL_ID, to, OTRL_INSTAG_BEST, msg, NULL, otr_msg,
+		OTRL_FRAGMENT_SEND_ALL_BUT_LAST, &ctx, add_peer_context_cb, irssi);
+	otr_sending = 0;
+	if (err) {
+		IRSSI_NOTICE(irssi, to, "Send failed.");
+		goto error;
+	}
+
+	/* Modify some libotr messages (OTR init in particular) to work better
+	 * with IRC. */
+	if (*otr_msg) {
+		utils_escape_message(*otr_msg);
+	}
+
+	IRSSI_DEBUG("Message sent...");
+
+	/* Add peer context to OTR context if none exists. */
+	if (ctx && !ctx->app_data) {
+		add_peer_context_cb(irssi, ctx);
+	}
+
+	return 0;
+
+error:
+	return -1;
+}
+
+/*
+ * Message sent by the worker, waiting for the main loop.
+ */
+struct otr_outgoing {
+	SERVER_REC *irssi;
+	char *to;
+	char *msg;
+	enum otr_sched_priority prio;
+	/* Left as plaintext by OTR. */
+	int plain;
+};
+
+static void outgoing_free(void *data)
+{
+	struct otr_outgoing *out = data;
+
+	free(out->to);
+	free(out->msg);
+	free(out);
+}
+
+static void queue_message(SERVER_REC *irssi, const char *to, const char *msg,
+		enum otr_sched_priority prio, int plain);
+
+static void outgoing_send_cb(void *data)
+{
+	struct otr_outgoing *out = data;
+
+	queue_message(out->irssi, out->to, out->msg, out->prio, out->plain);
+}
+
+static void queue_message(SERVER_REC *irssi, const char *to, const char *msg,
+		enum otr_sched_priority prio, int plain)
+{
+	struct otr_server_data *data;
+	struct otr_outgoing *out;
+
+	if (worker_in_thread()) {
+		out = zmalloc(sizeof(*out));
+		if (!out) {
+			return;
+		}
+		out->irssi = irssi;
+		out->to = strdup(to);
+		out->msg = strdup(msg);
+		out->prio = prio;
+		out->plain = plain;
+		if (!out->to || !out->msg) {
+			outgoing_free(out);
+			return;
+		}
+		worker_defer(outgoing_send_cb, out, outgoing_free);
+		return;
+	}
+
+	/* The server went away while the worker was busy. */
+	if (irssi && irssi->disconnected) {
+		return;
+	}
+
+	data = irssi ? get_server_data(irssi) : NULL;
+
+	/*
+	 * Plaintext is not paced by the scheduler unless OTR output to the same
+	 * peer is still queued, it then waits its turn to keep the order.
+	 */
+	if (plain && (!data || !sched_pending(data->sched, to))) {
+		sched_send_now(irssi, to, msg);
+		return;
+	}
+
+	if (!data || !data->sched) {
+		irssi_send_message(irssi, to, msg);
+		return;
+	}
+
+	sched_send(data->sched, to, msg, prio);
+}
+
+/*
+ * Send a message through the outbound scheduler of the server. From the
+ * worker, the message is handed to the main loop keeping the order.
+ */
+void otr_queue_message(SERVER_REC *irssi, const char *to, const char *msg,
+		enum otr_sched_priority prio)
+{
+	queue_message(irssi, to, msg, prio, 0);
+}
+
+/*
+ * Send a message OTR left as plaintext, straight to irssi. From the worker,
+ * the message is handed to the main loop keeping the order.
+ */
+void otr_send_plaintext(SERVER_REC *irssi, const char *to, const char *msg)
+{
+	queue_message(irssi, to, msg, OTR_SCHED_BULK, 1);
+}
+
+/*
+ * Send a message injected by libotr. Fragments of user data are sent after
+ * protocol traffic of other peers.
+ */
+void otr_inject_message(SERVER_REC *irssi, const char *to, const char *msg)
+{
+	otr_queue_message(irssi, to, msg,
+			otr_sending ? OTR_SCHED_BULK : OTR_SCHED_CONTROL);
+}
+
+/*
+ * Post a job to the worker on behalf of a server record and a peer, both
+ * optional. The account name and message size of the pair are snapshot now
+ * since the worker can not look at the server record. On error, the job data
+ * is released.
+ *
+ * Return 0 on success or else a negative value.
+ */
+int otr_post_job(SERVER_REC *irssi, const char *target, worker_func_t func,
+		void *data, worker_func_t free_data)
+{
+	struct worker_job *job;
+
+	job = worker_job_new(func, data, free_data);
+	if (!job) {
+		goto error;
+	}
+
+	if (target) {
+		job->target = strdup(target);
+		if (!job->target) {
+			free(job);
+			goto error;
+		}
+	}
+
+	if (irssi) {
+		job->server = irssi;
+		job->accname = get_account_name(irssi);
+		job->max_msg_size = otr_max_msg_size(irssi, target);
+	}
+
+	worker_post(job);
+	return 0;
+
+error:
+	if (free_data) {
+		free_data(data);
+	}
+	return -1;
+}
+
+/*
+ * Parse the otr_max_msg_size_networks setting, "name=size" pairs separated
+ * by spaces, in the table looked up for each message.
+ */
+void otr_load_msg_size_networks(void)
+{
+	int i;
+	char **pairs, *sep;
+	struct otr_network_size *entry;
+
+	if (!network_sizes) {
+		return;
+	}
+
+	g_hash_table_remove_all(network_sizes);
+
+	pairs = g_strsplit(settings_get_str(OTR_SET_MAX_MSG_SIZE_NETWORKS), " ", -1);
+
+	for (i = 0; pairs[i]; i++) {
+		sep = strchr(pairs[i], '=');
+		if (!sep) {
+			continue;
+		}
+		*sep = '\0';
+
+		/* Only the first pair of a name is ever matched. */
+		if (g_hash_table_contains(network_sizes, pairs[i])) {
+			continue;
+		}
+
+		entry = zmalloc(sizeof(*entry));
+		if (!entry) {
+			break;
+		}
+		entry->size = atoi(sep + 1);
+		entry->pos = i;
+
+		g_hash_table_insert(network_sizes, g_strdup(pairs[i]), entry);
+	}
+
+	g_strfreev(pairs);
+}
+
+/*
+ * Lookup the message size override of the server in the
+ * otr_max_msg_size_networks setting.
+ *
+ * Return 0 if found with the size set in size or else a negative value.
+ */
+static int network_msg_size(SERVER_REC *irssi, int *size)
+{
+	const char *chatnet;
+	struct otr_network_size *by_chatnet = NULL, *by_tag = NULL, *entry;
+
+	if (!network_sizes || g_hash_table_size(network_sizes) == 0) {
+		return -1;
+	}
+
+	chatnet = irssi->connrec ? irssi->connrec->chatnet : NULL;
+	if (chatnet) {
+		by_chatnet = g_hash_table_lookup(network_sizes, chatnet);
+	}
+	if (irssi->tag) {
+		by_tag = g_hash_table_lookup(network_sizes, irssi->tag);
+	}
+
+	entry = by_chatnet;
+	if (!entry || (by_tag && by_tag->pos < entry->pos)) {
+		entry = by_tag;
+	}
+	if (!entry) {
+		return -1;
+	}
+
+	*size = entry->size;
+	return 0;
+}
+
+/*
+ * Return the maximum size of an OTR message sent to the given nickname or 0
+ * for no fragmentation.
+ *
+ * On IRC, the line relayed to the peer is prefixed by our nick!user@host and
+ * the target so the payload budget is what remains of the 512 bytes line.
+ * Other chat protocols have no such limit.
+ *
+ * The worker uses the size snapshot for the peer of its job. Messages to any
+ * other peer get the smallest size.
+ */
+int otr_max_msg_size(SERVER_REC *irssi, const char *to)
+{
+	int ret, size;
+	size_t prefix_len, userhost_len;
+	IRC_SERVER_REC *irc;
+	const struct worker_job *job;
+
+	if (!irssi) {
+		size = 0;
+		goto end;
+	}
+
+	job = worker_current_job();
+	if (job && !job->sync) {
+		if (job->server == irssi && job->target && to &&
+				strcmp(job->target, to) == 0) {
+			size = job->max_msg_size;
+		} else {
+			size = OTR_MIN_MSG_SIZE;
+		}
+		goto end;
+	}
+
+	ret = network_msg_size(irssi, &size);
+	if (ret == 0) {
+		goto end;
+	}
+
+	size = settings_get_int(OTR_SET_MAX_MSG_SIZE);
+	if (size > 0) {
+		goto end;
+	}
+
+	irc = IRC_SERVER(irssi);
+	if (!irc) {
+		size = 0;
+		goto end;
+	}
+
+	if (irc->userhost) {
+		userhost_len = strlen(irc->userhost);
+	} else {
+		userhost_len = OTR_IRC_MAX_USERHOST;
+	}
+
+	/* ":nick!user@host PRIVMSG target :" and CRLF. */
+	prefix_len = 1 + strlen(IRSSI_NICK(irssi)) + 1 + userhost_len +
+		strlen(" PRIVMSG ") + (to ? strlen(to) : 0) + strlen(" :") + 2;
+
+	size = OTR_IRC_MAX_LINE - OTR_IRC_LINE_MARGIN - (int) prefix_len;
+	if (!irc->userhost && size < OTR_IRC_DEFAULT_MSG_SIZE) {
+		/* Not worse than the fixed size until user@host is known. */
+		size = OTR_IRC_DEFAULT_MSG_SIZE;
+	} else if (size < OTR_MIN_MSG_SIZE) {
+		size = OTR_MIN_MSG_SIZE;
+	}
+
+end:
+	if (size < 0) {
+		size = 0;
+	}
+	IRSSI_DEBUG("Max message size for %s: %d", to, size);
+	return size;
+}
+
+/*
+ * Compute the status bar format of a context.
+ */
+static enum otr_status_format compute_status_format(SERVER_REC *irssi,
+		const char *nick, ConnContext *ctx)
+{
+	int ret;
+	enum otr_status_format code;
+
+	assert(ctx);
+
+	switch (ctx->msgstate) {
+	case OTRL_MSGSTATE_PLAINTEXT:
+		code = TXT_STB_PLAINTEXT;
+		break;
+	case OTRL_MSGSTATE_ENCRYPTED:
+		/* Begin by checking trust. */
+		ret = otrl_context_is_fingerprint_trusted(ctx->active_fingerprint);
+		if (ret) {
+			code = TXT_STB_TRUST;
+		} else {
+			code = TXT_STB_UNTRUSTED;
+		}
+		break;
+	case OTRL_MSGSTATE_FINISHED:
+		code = TXT_STB_FINISHED;
+		break;
+	default:
+		IRSSI_NOTICE(irssi, nick, "BUG Found! "
+				"Please write us a mail and describe how you got here");
+		code = TXT_STB_UNKNOWN;
+		break;
+	}
+
+	IRSSI_DEBUG("Code: %d, state: %d, sm_prog_state: %d, auth state: %d",
+			code, ctx->msgstate, ctx->smstate->sm_prog_state,
+			ctx->auth.authstate);
+
+	return code;
 }
 
 /*
- * Find context from nickname and irssi server record.
+ * Add the status bar format of a conversation to a publication.
  */
-ConnContext *otr_find_context(SERVER_REC *irssi, const char *nick, int create)
+static void status_publish_add(struct otr_status_publish *publish,
+		const char *accname, const char *nick, enum otr_status_format format)
 {
-	char *accname = NULL;
-	ConnContext *ctx = NULL;
-
-	assert(irssi);
-	assert(nick);
+	struct otr_status_entry *entry;
 
-	accname = create_account_name(irssi);
-	if (!accname) {
+	entry = zmalloc(sizeof(*entry));
+	if (!entry) {
 		goto error;
 	}
 
-	ctx = otrl_context_find(user_state_global->otr_state, nick, accname,
-			OTR_PROTOCOL_ID, OTRL_INSTAG_BEST, create, NULL,
-			add_peer_context_cb, irssi);
+	entry->key.accname = strdup(accname);
+	entry->key.nick = strdup(nick);
+	if (!entry->key.accname || !entry->key.nick) {
+		status_entry_free(entry);
+		goto error;
+	}
+	entry->format = format;
 
-	free(accname);
+	publish->entries = g_slist_prepend(publish->entries, entry);
 
 error:
-	return ctx;
-}
-
-/*
- * Create otr peer context.
- */
-struct otr_peer_context *otr_create_peer_context(void)
-{
-	return zmalloc(sizeof(struct otr_peer_context));
+	return;
 }
 
 /*
- * Return a newly allocated OTR user state.
+ * Compute the status bar format of the conversation of the master context, or
+ * of the one with nick if NULL, and publish it to the main loop along with the
+ * event if it is not negative. Nothing is computed for an unknown nick, the
+ * event is still published.
  */
-struct otr_user_state *otr_init_user_state(void)
+static void status_publish(SERVER_REC *irssi, const char *nick, int event,
+		ConnContext *master)
 {
-	struct otr_user_state *ous = NULL;
+	const char *accname;
+	ConnContext *ctx;
+	struct otr_status_publish *publish;
 
-	ous = zmalloc(sizeof(*ous));
-	if (!ous) {
+	publish = zmalloc(sizeof(*publish));
+	if (!publish) {
 		goto error;
 	}
 
-	ous->otr_state = otrl_userstate_create();
-
-	instag_load(ous);
+	if (nick) {
+		publish->nick = strdup(nick);
+		if (!publish->nick) {
+			free(publish);
+			goto error;
+		}
+	}
+	publish->irssi = irssi;
+	publish->event = event;
+
+	if (master) {
+		status_publish_add(publish, master->accountname, master->username,
+				compute_status_format(irssi, master->username,
+					otrl_context_find_recent_secure_instance(master)));
+	} else if (irssi && nick) {
+		accname = get_account_name(irssi);
+		ctx = otr_find_context(irssi, nick, FALSE);
+		if (accname) {
+			status_publish_add(publish, accname, nick, ctx ?
+					compute_status_format(irssi, nick, ctx) :
+					TXT_STB_PLAINTEXT);
+		}
+	}
 
-	/* Load keys and fingerprints. */
-	key_load(ous);
-	key_load_fingerprints(ous);
+	worker_defer(status_publish_cb, publish, status_publish_free);
 
 error:
-	return ous;
+	return;
 }
 
 /*
- * Destroy otr user state.
+ * Drop the status bar format of a forgotten conversation from the mirror.
  */
-void otr_free_user_state(struct otr_user_state *ustate)
+static void status_publish_removed(const struct otr_context_key *key)
 {
-	if (ustate->otr_state) {
-		otrl_userstate_free(ustate->otr_state);
-		ustate->otr_state = NULL;
+	struct otr_status_publish *publish;
+
+	publish = zmalloc(sizeof(*publish));
+	if (!publish) {
+		goto error;
 	}
+	publish->event = -1;
 
-	free(ustate);
-}
+	status_publish_add(publish, key->accname, key->nick, TXT_STB_PLAINTEXT);
+	if (!publish->entries) {
+		status_publish_free(publish);
+		goto error;
+	}
+	((struct otr_status_entry *) publish->entries->data)->removed = 1;
 
-/*
- * init otr lib.
- */
-void otr_lib_init()
-{
-	OTRL_INIT;
-}
+	worker_defer(status_publish_cb, publish, status_publish_free);
 
-/*
- * deinit otr lib.
- */
-void otr_lib_uninit()
-{
+error:
+	return;
 }
 
 /*
- * Hand the given message to OTR.
- *
- * Return 0 if the message was successfully handled or else a negative value.
+ * Get the OTR status of this conversation. The status bar calls this on each
+ * redraw from the main loop so the format published by the worker is used.
  */
-int otr_send(SERVER_REC *irssi, const char *msg, const char *to, char **otr_msg)
+enum otr_status_format otr_get_status_format(SERVER_REC *irssi,
+		const char *nick)
 {
-	gcry_error_t err;
-	char *accname = NULL;
-	ConnContext *ctx = NULL;
+	gpointer format;
+	const char *accname;
+	struct otr_context_key key;
 
 	assert(irssi);
 
-	accname = create_account_name(irssi);
-	if (!accname) {
-		goto error;
-	}
-
-	IRSSI_DEBUG("Sending message...");
-
-	err = otrl_message_sending(user_state_global->otr_state, &otr_ops,
-		irssi, accname, OTR_PROTOCOL_ID, to, OTRL_INSTAG_BEST, msg, NULL, otr_msg,
-		OTRL_FRAGMENT_SEND_ALL_BUT_LAST, &ctx, add_peer_context_cb, irssi);
-	if (err) {
-		IRSSI_NOTICE(irssi, to, "Send failed.");
-		goto error;
-	}
-
-	/* Modify some libotr messages (OTR init in particular) to work better
-	 * with IRC. */
-	if (*otr_msg) {
-		utils_escape_message(*otr_msg);
+	accname = get_account_name(irssi);
+	if (!accname || !nick) {
+		return TXT_STB_PLAINTEXT;
 	}
 
-	IRSSI_DEBUG("Message sent...");
+	/* The key is only read so casting the const away is fine. */
+	key.accname = (char *) accname;
+	key.nick = (char *) nick;
 
-	/* Add peer context to OTR context if none exists. */
-	if (ctx && !ctx->app_data) {
-		add_peer_context_cb(irssi, ctx);
+	/*
+	 * Formats are stored as is, 0 being a valid one, so presence is told
+	 * by the lookup rather than by the value.
+	 */
+	if (!g_hash_table_lookup_extended(status_mirror, &key, NULL, &format)) {
+		return TXT_STB_PLAINTEXT;
 	}
 
-	free(accname);
-	return 0;
+	return GPOINTER_TO_INT(format);
+}
 
-error:
-	free(accname);
-	return -1;
+/*
+ * Change status bar text for a given nickname. The statusbar redraw and the
+ * "otr event" signal are deferred to the main loop and coalesced.
+ */
+void otr_status_change(SERVER_REC *irssi, const char *nick,
+		enum otr_status_event event)
+{
+	/*
+	 * Without a nick (context list update) only the event is published, the
+	 * state changes of a conversation come with their own event.
+	 */
+	status_publish(irssi, nick, event, NULL);
 }
 
 /*
- * List otr contexts to the main Irssi windows.
+ * List the contexts of a libotr user state.
  */
-void otr_contexts(struct otr_user_state *ustate)
+static void contexts_print(OtrlUserState us)
 {
 	char human_fp[OTRL_PRIVKEY_FPRINT_HUMAN_LEN], *trust;
 	ConnContext *ctx, *c_iter;
 	Fingerprint *fp;
 
-	assert(ustate);
-
-	if (!ustate->otr_state->context_root) {
-		IRSSI_INFO(NULL, NULL, "No active OTR contexts found");
-		goto end;
-	}
-
-	IRSSI_MSG("[ %KUser%n - %KAccount%n - %KStatus%n - %KFingerprint%n - "
-			"%KTrust%n ]");
-
 	/* Iterate over all contextes of the user state. */
-	for (ctx = ustate->otr_state->context_root; ctx != NULL; ctx = ctx->next) {
+	for (ctx = us->context_root; ctx != NULL; ctx = ctx->next) {
 		OtrlMessageState best_mstate = OTRL_MSGSTATE_PLAINTEXT;
 
 		/* Skip master context. */
@@ -475,8 +2710,44 @@ void otr_contexts(struct otr_user_state *ustate)
 			}
 		}
 	}
+}
+
+/*
+ * List otr contexts to the main Irssi windows.
+ */
+void otr_contexts(struct otr_user_state *ustate)
+{
+	int found = 0;
+	GList *states, *tmp;
+	struct otr_user_state *shard;
+
+	assert(ustate);
+
+	states = otr_user_state_list(ustate);
+
+	for (tmp = states; tmp; tmp = tmp->next) {
+		shard = tmp->data;
+		if (shard->otr_state->context_root) {
+			found = 1;
+			break;
+		}
+	}
+
+	if (!found) {
+		IRSSI_INFO(NULL, NULL, "No active OTR contexts found");
+		goto end;
+	}
+
+	IRSSI_MSG("[ %KUser%n - %KAccount%n - %KStatus%n - %KFingerprint%n - "
+			"%KTrust%n ]");
+
+	for (tmp = states; tmp; tmp = tmp->next) {
+		shard = tmp->data;
+		contexts_print(shard->otr_state);
+	}
 
 end:
+	g_list_free(states);
 	return;
 }
 
@@ -496,7 +2767,7 @@ void otr_finish(SERVER_REC *irssi, const char *nick)
 		goto end;
 	}
 
-	otrl_message_disconnect(user_state_global->otr_state, &otr_ops, irssi,
+	otrl_message_disconnect(get_otr_state(ctx->accountname), &otr_ops, irssi,
 			ctx->accountname, OTR_PROTOCOL_ID, nick, ctx->their_instance);
 
 	otr_status_change(irssi, nick, OTR_STATUS_FINISHED);
@@ -513,27 +2784,37 @@ end:
  */
 void otr_finishall(struct otr_user_state *ustate)
 {
+	GList *states, *tmp;
 	ConnContext *context;
 	SERVER_REC *irssi;
+	struct otr_user_state *shard;
 
 	assert(ustate);
 
-	for (context = ustate->otr_state->context_root; context;
-			context = context->next) {
-		/* Only finish encrypted session. */
-		if (context->msgstate != OTRL_MSGSTATE_ENCRYPTED) {
-			continue;
-		}
+	states = otr_user_state_list(ustate);
 
-		irssi = find_irssi_by_account_name(context->accountname);
-		if (!irssi) {
-			IRSSI_DEBUG("Unable to find server window for account %s",
-					context->accountname);
-			continue;
-		}
+	for (tmp = states; tmp; tmp = tmp->next) {
+		shard = tmp->data;
+
+		for (context = shard->otr_state->context_root; context;
+				context = context->next) {
+			/* Only finish encrypted session. */
+			if (context->msgstate != OTRL_MSGSTATE_ENCRYPTED) {
+				continue;
+			}
+
+			irssi = find_irssi_by_account_name(context->accountname);
+			if (!irssi) {
+				IRSSI_DEBUG("Unable to find server window for account %s",
+						context->accountname);
+				continue;
+			}
 
-		otr_finish(irssi, context->username);
+			otr_finish(irssi, context->username);
+		}
 	}
+
+	g_list_free(states);
 }
 
 /*
@@ -583,7 +2864,9 @@ void otr_trust(SERVER_REC *irssi, const char *nick, char *str_fp,
 		otrl_context_set_trust(fp_trust, "manual");
 		key_write_fingerprints(ustate);
 
-		otr_status_change(irssi, nick, OTR_STATUS_TRUST_MANUAL);
+		/* The fingerprint might belong to another conversation. */
+		status_publish(irssi, nick, OTR_STATUS_TRUST_MANUAL,
+				fp_trust->context);
 
 		otrl_privkey_hash_to_human(peerfp, fp_trust->fingerprint);
 		IRSSI_NOTICE(irssi, nick, "Fingerprint %g%s%n trusted!", peerfp);
@@ -613,7 +2896,8 @@ void otr_auth_abort(SERVER_REC *irssi, const char *nick)
 		goto end;
 	}
 
-	otrl_message_abort_smp(user_state_global->otr_state, &otr_ops, irssi, ctx);
+	otrl_message_abort_smp(get_otr_state(ctx->accountname), &otr_ops, irssi,
+			ctx);
 	otr_status_change(irssi, nick, OTR_STATUS_SMP_ABORT);
 
 	if (ctx->smstate->nextExpected != OTRL_SMP_EXPECT1) {
@@ -677,17 +2961,17 @@ void otr_auth(SERVER_REC *irssi, const char *nick, const char *question,
 	}
 
 	if (opc->ask_secret) {
-		otrl_message_respond_smp(user_state_global->otr_state, &otr_ops,
+		otrl_message_respond_smp(get_otr_state(ctx->accountname), &otr_ops,
 				irssi, ctx, (unsigned char *) secret, secret_len);
 		otr_status_change(irssi, nick, OTR_STATUS_SMP_RESPONDED);
 		IRSSI_NOTICE(irssi, nick, "%yResponding to authentication...%n");
 	} else {
 		if (question) {
-			otrl_message_initiate_smp_q(user_state_global->otr_state,
+			otrl_message_initiate_smp_q(get_otr_state(ctx->accountname),
 				&otr_ops, irssi, ctx, question, (unsigned char *) secret,
 				secret_len);
 		} else {
-			otrl_message_initiate_smp(user_state_global->otr_state,
+			otrl_message_initiate_smp(get_otr_state(ctx->accountname),
 				&otr_ops, irssi, ctx, (unsigned char *) secret, secret_len);
 		}
 		otr_status_change(irssi, nick, OTR_STATUS_SMP_STARTED);
@@ -700,112 +2984,6 @@ end:
 	return;
 }
 
-/*
- * For the given message we received through irssi, check if we need to queue
- * it for the case where that message is part of a bigger OTR full message.
- * This can happen with bitlbee for instance where OTR message are split in
- * different PRIVMSG.
- *
- * This uses a "queue" in the peer context so it's it very important to have
- * the peer context associated with the message (nickname + irssi object).
- *
- * Return an otr_msg_status code indicating the caller what to do with the msg.
- * OTR_MSG_ERROR indicates an error probably memory related. OTR_MSG_WAIT_MORE
- * tells the caller to NOT send out the message since we are waiting for more
- * to complete the OTR original message. OTR_MSG_ORIGINAL tell the caller to
- * simply use the original message. OTR_MSG_USE_QUEUE indicates that full_msg
- * can be used containing the reconstructed message. The caller SHOULD free(3)
- * this pointer after use.
- */
-static enum otr_msg_status enqueue_otr_fragment(const char *msg,
-		struct otr_peer_context *opc, char **full_msg)
-{
-	enum otr_msg_status ret;
-	size_t msg_len;
-
-	assert(msg);
-	assert(opc);
-
-	/* We are going to use it quite a bit so ease our life a bit. */
-	msg_len = strlen(msg);
-
-	if (opc->full_msg) {
-		if (msg_len > (opc->msg_size - opc->msg_len)) {
-			char *tmp_ptr;
-
-			/* Realloc memory if there is not enough space. */
-			tmp_ptr = realloc(opc->full_msg, opc->msg_size + msg_len + 1);
-			if (!tmp_ptr) {
-				free(opc->full_msg);
-				opc->full_msg = NULL;
-				ret = OTR_MSG_ERROR;
-				goto end;
-			}
-			opc->full_msg = tmp_ptr;
-			opc->msg_size += msg_len + 1;
-		}
-
-		/* Copy msg to full message since we already have a part pending. */
-		strncpy(opc->full_msg + opc->msg_len, msg, msg_len);
-		opc->msg_len += msg_len;
-		opc->full_msg[opc->msg_len] = '\0';
-
-		IRSSI_DEBUG("Partial OTR message added to queue: %s", msg);
-
-		/*
-		 * Are we waiting for more? If the message ends with a ".", the
-		 * transmission has ended else we have to wait for more.
-		 */
-		if (msg[msg_len - 1] != OTR_MSG_END_TAG) {
-			ret = OTR_MSG_WAIT_MORE;
-			goto end;
-		}
-
-		/*
-		 * Dup the string with enough space for the NULL byte since we are
-		 * about to free it before passing it to the caller.
-		 */
-		*full_msg = strndup(opc->full_msg, opc->msg_len + 1);
-		/* Reset everything. */
-		free(opc->full_msg);
-		opc->full_msg = NULL;
-		opc->msg_size = opc->msg_len = 0;
-		ret = OTR_MSG_USE_QUEUE;
-		goto end;
-	} else {
-		char *pos;
-
-		/*
-		 * Try to find the OTR message tag at the _beginning_of the packet and
-		 * check if this packet is not the end with the end tag of OTR "."
-		 */
-		pos = strstr(msg, OTR_MSG_BEGIN_TAG);
-		if (pos && (pos == msg) && msg[msg_len - 1] != OTR_MSG_END_TAG) {
-			/* Allocate full message buffer with an extra for NULL byte. */
-			opc->full_msg = zmalloc((msg_len * 2) + 1);
-			if (!opc->full_msg) {
-				ret = OTR_MSG_ERROR;
-				goto end;
-			}
-			/* Copy full message with NULL terminated byte. */
-			strncpy(opc->full_msg, msg, msg_len);
-			opc->msg_len += msg_len;
-			opc->msg_size += ((msg_len * 2) + 1);
-			opc->full_msg[opc->msg_len] = '\0';
-			ret = OTR_MSG_WAIT_MORE;
-			IRSSI_DEBUG("Partial OTR message begins the queue: %s", msg);
-			goto end;
-		}
-
-		/* Use original message. */
-		ret = OTR_MSG_ORIGINAL;
-		goto end;
-	}
-
-end:
-	return ret;
-}
-
 /*
  * Hand the given message to OTR.
  *
@@ -815,19 +2993,27 @@ int otr_receive(SERVER_REC *irssi, const char *msg, const char *from,
 		char **new_msg)
 {
 	int ret = -1;
-	char *accname = NULL, *full_msg = NULL;
+	char *full_msg = NULL;
+	const char *accname;
 	const char *recv_msg = NULL;
 	OtrlTLV *tlvs;
+	OtrlInsTag *instag;
 	ConnContext *ctx;
+	OtrlUserState us;
 	struct otr_peer_context *opc;
 
 	assert(irssi);
 
-	accname = create_account_name(irssi);
+	accname = get_account_name(irssi);
 	if (!accname) {
 		goto error;
 	}
 
+	us = get_otr_state(accname);
+	if (!us) {
+		goto error;
+	}
+
 	IRSSI_DEBUG("Receiving message...");
 
 	ctx = otr_find_context(irssi, from, 1);
@@ -840,15 +3026,29 @@ int otr_receive(SERVER_REC *irssi, const char *msg, const char *from,
 		add_peer_context_cb(irssi, ctx);
 	}
 
-	opc = ctx->app_data;
+	/*
+	 * Fragments are reassembled in the master context since the best
+	 * instance can change in between.
+	 */
+	if (!ctx->m_context->app_data) {
+		add_peer_context_cb(irssi, ctx->m_context);
+	}
+
+	opc = ctx->m_context->app_data;
 	assert(opc);
 
-	ret = enqueue_otr_fragment(msg, opc, &full_msg);
+	instag = otrl_instag_find(us, accname, OTR_PROTOCOL_ID);
+
+	ret = fragment_enqueue(&opc->fragments, msg,
+			instag ? instag->instag : 0, &full_msg);
+	/* Expiry of pending fragments needs the timer. */
+	otr_timer_update();
 	switch (ret) {
 	case OTR_MSG_ORIGINAL:
 		recv_msg = msg;
 		break;
 	case OTR_MSG_WAIT_MORE:
+	case OTR_MSG_DROP:
 		ret = 1;
 		goto error;
 	case OTR_MSG_USE_QUEUE:
@@ -859,9 +3059,9 @@ int otr_receive(SERVER_REC *irssi, const char *msg, const char *from,
 		goto error;
 	}
 
-	ret = otrl_message_receiving(user_state_global->otr_state,
-		&otr_ops, irssi, accname, OTR_PROTOCOL_ID, from, recv_msg, new_msg,
-		&tlvs, &ctx, add_peer_context_cb, irssi);
+	ret = otrl_message_receiving(us, &otr_ops, irssi, accname,
+		OTR_PROTOCOL_ID, from, recv_msg, new_msg, &tlvs, &ctx,
+		add_peer_context_cb, irssi);
 	if (ret) {
 		IRSSI_DEBUG("Ignoring message of length %d from %s to %s.\n"
 				"%s", strlen(msg), from, accname, msg);
@@ -889,95 +3089,58 @@ error:
 	if (full_msg) {
 		free(full_msg);
 	}
-	free(accname);
 	return ret;
 }
 
 /*
- * Get the OTR status of this conversation.
+ * Search for a OTR Fingerprint object from the given human readable string and
+ * return a pointer to the object if found else NULL. A unique leading part of
+ * the human readable fingerprint is enough.
  */
-enum otr_status_format otr_get_status_format(SERVER_REC *irssi,
-		const char *nick)
+Fingerprint *otr_find_hash_fingerprint_from_human(const char *human_fp,
+		struct otr_user_state *ustate)
 {
-	int ret;
-	enum otr_status_format code;
-	ConnContext *ctx = NULL;
+	int ndigits;
+	size_t pos;
+	unsigned char hash[20];
+	Fingerprint *fp = NULL;
+	struct otr_fp_entry *entry = NULL, *next;
 
-	assert(irssi);
+	assert(human_fp);
+	assert(ustate);
 
-	ctx = otr_find_context(irssi, nick, FALSE);
-	if (!ctx) {
-		code = TXT_STB_PLAINTEXT;
+	ndigits = utils_human_fp_to_hash(human_fp, hash);
+	if (ndigits <= 0) {
 		goto end;
 	}
 
-	switch (ctx->msgstate) {
-	case OTRL_MSGSTATE_PLAINTEXT:
-		code = TXT_STB_PLAINTEXT;
-		break;
-	case OTRL_MSGSTATE_ENCRYPTED:
-		/* Begin by checking trust. */
-		ret = otrl_context_is_fingerprint_trusted(ctx->active_fingerprint);
-		if (ret) {
-			code = TXT_STB_TRUST;
-		} else {
-			code = TXT_STB_UNTRUSTED;
+	if (ndigits == 40) {
+		entry = g_hash_table_lookup(fp_index, hash);
+	} else {
+		pos = fp_sorted_lower_bound(hash, ndigits);
+		if (pos == fp_sorted_len ||
+				fp_prefix_cmp(fp_sorted[pos]->hash, hash, ndigits) != 0) {
+			goto end;
 		}
-		break;
-	case OTRL_MSGSTATE_FINISHED:
-		code = TXT_STB_FINISHED;
-		break;
-	default:
-		IRSSI_NOTICE(irssi, nick, "BUG Found! "
-				"Please write us a mail and describe how you got here");
-		code = TXT_STB_UNKNOWN;
-		break;
-	}
-
-end:
-	if (ctx) {
-		IRSSI_DEBUG("Code: %d, state: %d, sm_prog_state: %d, auth state: %d",
-				code, ctx->msgstate, ctx->smstate->sm_prog_state,
-				ctx->auth.authstate);
+		if (pos + 1 < fp_sorted_len &&
+				fp_prefix_cmp(fp_sorted[pos + 1]->hash, hash, ndigits) == 0) {
+			IRSSI_INFO(NULL, NULL, "Fingerprint %y%s%n is ambiguous",
+					human_fp);
+			goto end;
+		}
+		entry = fp_sorted[pos];
 	}
-	return code;
-}
-
-/*
- * Change status bar text for a given nickname.
- */
-void otr_status_change(SERVER_REC *irssi, const char *nick,
-		enum otr_status_event event)
-{
-	statusbar_items_redraw("otr");
-	signal_emit("otr event", 3, irssi, nick, statusbar_txt[event]);
-}
 
-/*
- * Search for a OTR Fingerprint object from the given human readable string and
- * return a pointer to the object if found else NULL.
- */
-Fingerprint *otr_find_hash_fingerprint_from_human(const char *human_fp,
-		struct otr_user_state *ustate)
-{
-	char str_fp[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
-	Fingerprint *fp = NULL, *fp_iter = NULL;
-	ConnContext *context;
+	for (; entry; entry = next) {
+		next = entry->next;
 
-	/* Loop on all context of the user state */
-	for (context = ustate->otr_state->context_root; context != NULL;
-			context = context->next) {
-		/* Loop on all fingerprint of the context */
-		for (fp_iter = context->fingerprint_root.next; fp_iter;
-				fp_iter = fp_iter->next) {
-			otrl_privkey_hash_to_human(str_fp, fp_iter->fingerprint);
-			/* Compare human fingerprint given in argument to the current. */
-			if (strncmp(str_fp, human_fp, sizeof(str_fp)) == 0) {
-				fp = otrl_context_find_fingerprint(context,
-						fp_iter->fingerprint, 0, NULL);
-				goto end;
-			}
+		fp = fp_entry_resolve(entry, ustate);
+		if (fp) {
+			break;
 		}
+
+		/* Libotr forgot it without telling us. */
+		fp_index_remove(entry->accname, entry->username, entry->hash);
 	}
 
 end:
@@ -1034,6 +3197,9 @@ void otr_forget(SERVER_REC *irssi, const char *nick, char *str_fp,
 		}
 
 		otrl_privkey_hash_to_human(fp, fp_forget->fingerprint);
+		/* Fingerprints are always attached to the master context. */
+		fp_index_remove(fp_forget->context->accountname,
+				fp_forget->context->username, fp_forget->fingerprint);
 		/* Forget fp and context if it's the only one remaining. */
 		otrl_context_forget_fingerprint(fp_forget, 1);
 		/* Update fingerprints file. */
@@ -1100,6 +3266,8 @@ void otr_distrust(SERVER_REC *irssi, const char *nick, char *str_fp,
 		otrl_context_set_trust(fp_distrust, "");
 		/* Update fingerprints file. */
 		key_write_fingerprints(ustate);
+		/* The fingerprint might belong to another conversation. */
+		status_publish(irssi, nick, -1, fp_distrust->context);
 		IRSSI_NOTICE(irssi, nick, "Fingerprint %y%s%n distrusted.",
 				fp);
 	} else {
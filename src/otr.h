@@ -28,16 +28,38 @@
 #include <libotr/context.h>
 #include <libotr/privkey.h>
 
+#include "fragment.h"
 #include "irssi-otr.h"
+#include "otr-formats.h"
+#include "otr-sched.h"
 #include "utils.h"
 
 /* irssi module name */
 #define MODULE_NAME                   "otr"
 
 /*
- * XXX: Maybe this should be configurable?
+ * IRC line budget. A line is at most 512 bytes with the CRLF and is relayed
+ * to the peer as ":nick!user@host PRIVMSG target :msg". When our user@host
+ * is not known yet, the longest one allowed by usual servers (USERLEN of 10
+ * and HOSTLEN of 63) is assumed but the size never goes below the fixed one
+ * used before the budget was computed. A margin covers a host changed by a
+ * cloak.
  */
-#define OTR_MAX_MSG_SIZE              400
+#define OTR_IRC_MAX_LINE              512
+#define OTR_IRC_MAX_USERHOST          (10 + 1 + 63)
+#define OTR_IRC_LINE_MARGIN           16
+#define OTR_IRC_DEFAULT_MSG_SIZE      400
+/* Smallest message size handed to libotr for fragmentation. */
+#define OTR_MIN_MSG_SIZE              128
+
+/*
+ * Message size settings. otr_max_msg_size forces the size for every server
+ * when not zero. otr_max_msg_size_networks overrides it per network with a
+ * space separated list of "chatnet=size" or "tag=size" pairs, a size of 0
+ * meaning no fragmentation (e.g. bitlbee).
+ */
+#define OTR_SET_MAX_MSG_SIZE          "otr_max_msg_size"
+#define OTR_SET_MAX_MSG_SIZE_NETWORKS "otr_max_msg_size_networks"
 
 /* OTR protocol id */
 #define OTR_PROTOCOL_ID               "IRC"
@@ -45,7 +67,11 @@
 #define OTR_DIR                       "/otr"
 #define OTR_KEYFILE                   OTR_DIR "/otr.key"
 #define OTR_FINGERPRINTS_FILE         OTR_DIR "/otr.fp"
+#define OTR_FINGERPRINTS_JOURNAL      OTR_DIR "/otr.fp.journal"
+#define OTR_FINGERPRINTS_SNAPSHOT     OTR_DIR "/otr.fp.bin"
 #define OTR_INSTAG_FILE               OTR_DIR "/otr.instag"
+#define OTR_KEYPOOL_FILE              OTR_DIR "/otr.keypool"
+#define OTR_LOCK_FILE                 OTR_DIR "/otr.lock"
 
 /*
  * Specified in OTR protocol version 3. See:
@@ -68,11 +94,64 @@
  */
 #define zmalloc(x) calloc(1, x)
 
+/*
+ * Keep one libotr user state per account name instead of a single one for
+ * the whole module. Read when the module loads.
+ */
+#define OTR_SET_SHARD_ACCOUNTS        "otr_shard_accounts"
+
+/*
+ * Shard per account and load an account only while one of its servers is
+ * connected. Read when the module loads.
+ */
+#define OTR_SET_LAZY_ACCOUNTS         "otr_lazy_accounts"
+
+/*
+ * Set up gcrypt, libotr and the user state on the first OTR message or /otr
+ * command instead of when the module loads. Read when the module loads.
+ */
+#define OTR_SET_LAZY_INIT             "otr_lazy_init"
+
+/*
+ * Part of the files kept as text for the accounts not loaded. The keys are
+ * only kept to load the account, otr.key is rewritten from itself.
+ */
+enum otr_dormant_file {
+	OTR_DORMANT_FINGERPRINTS	= 0,
+	OTR_DORMANT_INSTAGS			= 1,
+	OTR_DORMANT_KEYS			= 2,
+};
+
 /* Irssi otr user state */
 struct otr_user_state {
+	/* NULL for the global state when sharded. */
 	OtrlUserState otr_state;
+	/*
+	 * Shards of the global state keyed by interned account name, NULL if not
+	 * sharded. Each shard holds the contexts, keys, fingerprints and instance
+	 * tags of its account only.
+	 */
+	GHashTable *shards;
+	/* Account name of a shard and the global state it belongs to. */
+	const char *accname;
+	struct otr_user_state *root;
+	/* Fingerprint changes are appended to a journal. Global state only. */
+	int fp_journal;
+	/*
+	 * Lazy mode: otr.fp, otr.instag and otr.key parts of the accounts without
+	 * a shard keyed by interned account name, NULL otherwise. Global state
+	 * only.
+	 */
+	GHashTable *dormant;
+	/*
+	 * Poll interval libotr asked for this libotr state, 0 if it has no old
+	 * keys to expire. Only used by the thread running libotr.
+	 */
+	unsigned int poll_interval;
 };
 
+struct otr_context_key;
+
 /*
  * Peer OTR internal context.
  */
@@ -90,13 +169,12 @@ struct otr_peer_context {
 	/*
 	 * If needed, used to reconstruct the full message from fragmentation.
 	 * Bitlbee for instance does that where we receive a *long* OTR message
-	 * split in multiple PRIVMSG so we need to reconstruct it.
+	 * split in multiple PRIVMSG so we need to reconstruct it. Only used in
+	 * the master context.
 	 */
-	char *full_msg;
-	/* Size of full_msg. Note this is the allocated memory size. */
-	size_t msg_size;
-	/* Len of the actual string in full_msg NOT counting the NULL byte. */
-	size_t msg_len;
+	struct otr_fragment_queue fragments;
+	/* Key in the context index if this is an indexed master context. */
+	struct otr_context_key *index_key;
 };
 
 /* given to otr_status_change */
@@ -118,13 +196,6 @@ enum otr_status_event {
 	OTR_STATUS_CTX_UPDATE
 };
 
-enum otr_msg_status {
-	OTR_MSG_ORIGINAL		= 1,
-	OTR_MSG_WAIT_MORE		= 2,
-	OTR_MSG_USE_QUEUE		= 3,
-	OTR_MSG_ERROR			= 4,
-};
-
 /* there can be only one */
 extern struct otr_user_state *user_state_global;
 
@@ -134,6 +205,7 @@ extern OtrlMessageAppOps otr_ops;
 /* Active debug or not */
 extern int debug;
 
+OtrlPolicy otr_policy(SERVER_REC *irssi, const char *nick);
 void irssi_send_message(SERVER_REC *irssi, const char *recipient,
 		const char *message);
 void otr_status_change(SERVER_REC *irssi, const char *nick,
@@ -142,18 +214,43 @@ void otr_status_change(SERVER_REC *irssi, const char *nick,
 /* init stuff */
 
 struct otr_user_state *otr_init_user_state(void);
+void otr_load_user_state(struct otr_user_state *ustate);
 void otr_free_user_state(struct otr_user_state *ustate);
+struct otr_user_state *otr_user_state_shard(struct otr_user_state *ustate,
+		const char *accname);
+GList *otr_user_state_list(struct otr_user_state *ustate);
+void otr_user_state_prune(struct otr_user_state *shard);
+void otr_user_state_release(struct otr_user_state *ustate,
+		const char *accname);
+gcry_error_t otr_user_state_write_dormant(struct otr_user_state *ustate,
+		enum otr_dormant_file file, FILE *fp);
+
+void otr_status_redraw(void);
 
 void otr_lib_init();
+void otr_load_msg_size_networks(void);
 void otr_lib_uninit();
 
 void otr_control_timer(unsigned int interval, void *opdata);
+void otr_timer_update(void);
+
+/* Server record tracking. */
+void otr_server_update(SERVER_REC *irssi);
+void otr_server_flush(SERVER_REC *irssi);
+void otr_server_free(SERVER_REC *irssi);
 
 /* Message transport. */
 int otr_send(SERVER_REC *irssi, const char *msg, const char *to,
 		char **otr_msg);
+void otr_queue_message(SERVER_REC *irssi, const char *to, const char *msg,
+		enum otr_sched_priority prio);
+void otr_send_plaintext(SERVER_REC *irssi, const char *to, const char *msg);
+void otr_inject_message(SERVER_REC *irssi, const char *to, const char *msg);
+int otr_max_msg_size(SERVER_REC *irssi, const char *to);
 int otr_receive(SERVER_REC *irssi, const char *msg,
 		const char *from, char **new_msg);
+int otr_post_job(SERVER_REC *irssi, const char *target, worker_func_t func,
+		void *data, worker_func_t free_data);
 
 /* User interaction */
 void otr_finish(SERVER_REC *irssi, const char *nick);
@@ -176,5 +273,10 @@ struct otr_peer_context *otr_create_peer_context(void);
 ConnContext *otr_find_context(SERVER_REC *irssi, const char *nick, int create);
 Fingerprint *otr_find_hash_fingerprint_from_human(const char *human_fp,
 		struct otr_user_state *ustate);
+void otr_fp_index_add(const char *accname, const char *username,
+		const unsigned char *hash);
+void otr_fp_apply(struct otr_user_state *ustate, const char *username,
+		const char *accname, const char *protocol, const unsigned char *hash,
+		const char *trust);
 
 #endif /* IRSSI_OTR_OTR_H */
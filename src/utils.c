@@ -34,7 +34,7 @@ static char *ltrim(char *s)
 {
 	assert(s);
 
-	while (isspace(*s)) {
+	while (isspace((unsigned char) *s)) {
 		s++;
 	}
 	return s;
@@ -58,7 +58,7 @@ static char *rtrim(char *s)
 	back = s + len;
 
 	/* Move up to the first non whitespace character. */
-	while (isspace(*--back));
+	while (isspace((unsigned char) *--back));
 	/* Remove whitespace(s) from the string. */
 	*(back + 1) = '\0';
 
@@ -377,7 +377,7 @@ void utils_string_to_upper(char *string)
 
 	while (string[i]) {
 		c = string[i];
-		string[i] = toupper(c);
+		string[i] = toupper((unsigned char) c);
 		i++;
 	}
 }
@@ -389,21 +389,35 @@ void utils_string_to_upper(char *string)
  *      D81D8363 F6D6090A C2632A53 352DADFA FD296A87
  *
  * Stores the result in dst which is basically regroup the string and upper
- * case it. The dst argument must be equal or larger than
+ * case it. Only the first nparts (1 to 5) are used so a leading part of a
+ * fingerprint can be given. The dst argument must be equal or larger than
  * OTRL_PRIVKEY_FPRINT_HUMAN_LEN.
  */
-void utils_hash_parts_to_readable_hash(const char **parts, char *dst)
+void utils_hash_parts_to_readable_hash(const char **parts, int nparts,
+		char *dst)
 {
-	int ret;
+	int i, ret;
+	size_t len = 0;
 
 	/* Safety net. This is a code flow error. */
-	assert(parts && parts[0] && parts[1] && parts[2] && parts[3] && parts[4]);
+	assert(parts && nparts > 0 && nparts <= 5);
 	assert(dst);
 
-	ret = snprintf(dst, OTRL_PRIVKEY_FPRINT_HUMAN_LEN, "%s %s %s %s %s",
-			parts[0], parts[1], parts[2], parts[3], parts[4]);
-	if (ret < 0) {
-		goto error;
+	dst[0] = '\0';
+
+	for (i = 0; i < nparts; i++) {
+		assert(parts[i]);
+
+		ret = snprintf(dst + len, OTRL_PRIVKEY_FPRINT_HUMAN_LEN - len, "%s%s",
+				(i > 0) ? " " : "", parts[i]);
+		if (ret < 0) {
+			goto error;
+		}
+		len += ret;
+		if (len >= OTRL_PRIVKEY_FPRINT_HUMAN_LEN) {
+			/* Truncated. The result is rejected when parsed. */
+			break;
+		}
 	}
 
 	/* In place upper case full string. */
@@ -412,3 +426,44 @@ void utils_hash_parts_to_readable_hash(const char **parts, char *dst)
 error:
 	return;
 }
+
+/*
+ * Parse a human readable fingerprint, or a leading part of it, into its 20
+ * bytes binary hash. Whitespaces are ignored and the hex digits are case
+ * insensitive. The unparsed trailing part of hash is zeroed.
+ *
+ * Return the number of hex digits parsed or a negative value if the string is
+ * not a valid fingerprint.
+ */
+int utils_human_fp_to_hash(const char *human_fp, unsigned char *hash)
+{
+	int ndigits = 0, value;
+	const char *c;
+
+	assert(human_fp);
+	assert(hash);
+
+	memset(hash, 0, 20);
+
+	for (c = human_fp; *c != '\0'; c++) {
+		if (isspace((unsigned char) *c)) {
+			continue;
+		}
+
+		value = g_ascii_xdigit_value(*c);
+		if (value < 0 || ndigits == 40) {
+			/* Not an hex digit or too long. */
+			return -1;
+		}
+
+		/* High nibble first. */
+		if (ndigits % 2 == 0) {
+			hash[ndigits / 2] = value << 4;
+		} else {
+			hash[ndigits / 2] |= value;
+		}
+		ndigits++;
+	}
+
+	return ndigits;
+}
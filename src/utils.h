@@ -27,7 +27,9 @@ void utils_explode_args(const char *_data, char ***_argv, int *_argc);
 int utils_io_extract_smp(const char *data, char **question, char **secret);
 void utils_string_to_upper(char *string);
 int utils_auth_extract_secret(const char *_data, char **secret);
-void utils_hash_parts_to_readable_hash(const char **parts, char *dst);
+void utils_hash_parts_to_readable_hash(const char **parts, int nparts,
+		char *dst);
+int utils_human_fp_to_hash(const char *human_fp, unsigned char *hash);
 char *utils_trim_string(char *s);
 char *utils_escape_message(char *s);
 
@@ -0,0 +1,134 @@
+/*
+ * Off-the-Record Messaging (OTR) modules for IRC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301,USA
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <assert.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "otr.h"
+#include "watch.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+static int watch_fd = -1;
+static guint watch_source;
+static watch_func_t watch_func;
+
+static gboolean watch_cb(GIOChannel *source, GIOCondition condition,
+		gpointer data)
+{
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char *ptr;
+	ssize_t len;
+	const struct inotify_event *event;
+
+	while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+				ptr += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *) ptr;
+			if (event->len > 0) {
+				watch_func(event->name);
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Watch the files written in a directory, either closed after writing or
+ * renamed in it as done to replace them atomically.
+ *
+ * Return 0 on success or else a negative value, nothing is then watched.
+ */
+int watch_init(const char *path, watch_func_t func)
+{
+	int ret;
+	GIOChannel *channel;
+
+	assert(path);
+	assert(func);
+
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch_fd < 0) {
+		IRSSI_DEBUG("Unable to watch %9%s%9: %s", path, strerror(errno));
+		goto error;
+	}
+
+	ret = inotify_add_watch(watch_fd, path, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (ret < 0) {
+		IRSSI_DEBUG("Unable to watch %9%s%9: %s", path, strerror(errno));
+		goto error_watch;
+	}
+
+	watch_func = func;
+
+	channel = g_io_channel_unix_new(watch_fd);
+	watch_source = g_io_add_watch(channel, G_IO_IN, watch_cb, NULL);
+	g_io_channel_unref(channel);
+
+	return 0;
+
+error_watch:
+	close(watch_fd);
+	watch_fd = -1;
+error:
+	return -1;
+}
+
+/*
+ * Stop watching.
+ */
+void watch_deinit(void)
+{
+	if (watch_fd < 0) {
+		return;
+	}
+
+	g_source_remove(watch_source);
+	watch_source = 0;
+	close(watch_fd);
+	watch_fd = -1;
+	watch_func = NULL;
+}
+
+#else /* HAVE_SYS_INOTIFY_H */
+
+/*
+ * Without inotify, the changes of the other instances are only merged when
+ * this one writes the files.
+ */
+int watch_init(const char *path, watch_func_t func)
+{
+	return -1;
+}
+
+void watch_deinit(void)
+{
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
@@ -0,0 +1,34 @@
+/*
+ * Off-the-Record Messaging (OTR) modules for IRC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301,USA
+ */
+
+#ifndef IRSSI_OTR_WATCH_H
+#define IRSSI_OTR_WATCH_H
+
+/*
+ * Watch of the OTR directory so the changes made to the files by other Irssi
+ * instances sharing it are noticed. Runs in the main loop, with inotify where
+ * available.
+ */
+
+/* Called in the main loop with the name of a file written in the directory. */
+typedef void (*watch_func_t)(const char *name);
+
+int watch_init(const char *path, watch_func_t func);
+void watch_deinit(void);
+
+#endif /* IRSSI_OTR_WATCH_H */
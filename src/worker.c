@@ -0,0 +1,503 @@
+/*
+ * Off-the-Record Messaging (OTR) modules for IRC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301,USA
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "otr.h"
+#include "worker.h"
+
+/*
+ * Call deferred to the main loop.
+ */
+struct worker_call {
+	worker_func_t func;
+	void *data;
+	worker_func_t free_data;
+};
+
+/*
+ * Text printed from the worker.
+ */
+struct worker_print {
+	void *server;
+	char *target;
+	int level;
+	char *text;
+};
+
+static pthread_t worker_thread;
+static int worker_running;
+
+/* Jobs for the worker and calls for the main loop. */
+static GAsyncQueue *worker_jobs;
+static GAsyncQueue *worker_calls;
+
+/* Wakeup pipe of the main loop. */
+static int wakeup_fds[2] = { -1, -1 };
+static guint wakeup_source;
+
+/* Job being run. Only used by the worker. */
+static struct worker_job *current_job;
+
+/* Completion of sync jobs. */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Release a job in the main loop.
+ */
+static void job_done(void *data)
+{
+	struct worker_job *job = data;
+
+	if (job->server) {
+		server_unref(job->server);
+	}
+	if (job->free_data) {
+		job->free_data(job->data);
+	}
+	free(job->target);
+	free(job);
+}
+
+/*
+ * Queue a call for the main loop and wake it up.
+ */
+static void push_call(worker_func_t func, void *data, worker_func_t free_data)
+{
+	ssize_t ret;
+	struct worker_call *call;
+
+	call = zmalloc(sizeof(*call));
+	if (!call) {
+		/* Nothing much to do, the call is lost. */
+		if (free_data) {
+			free_data(data);
+		}
+		return;
+	}
+
+	call->func = func;
+	call->data = data;
+	call->free_data = free_data;
+	g_async_queue_push(worker_calls, call);
+
+	/* The pipe might be full but one byte pending is enough. */
+	do {
+		ret = write(wakeup_fds[1], "", 1);
+	} while (ret < 0 && errno == EINTR);
+}
+
+/*
+ * Run the calls deferred by the worker.
+ */
+static void dispatch_calls(void)
+{
+	struct worker_call *call;
+
+	while ((call = g_async_queue_try_pop(worker_calls))) {
+		if (call->func) {
+			call->func(call->data);
+		}
+		if (call->free_data) {
+			call->free_data(call->data);
+		}
+		free(call);
+	}
+}
+
+static gboolean wakeup_cb(GIOChannel *source, GIOCondition condition,
+		gpointer data)
+{
+	char buf[64];
+
+	while (read(wakeup_fds[0], buf, sizeof(buf)) > 0) {
+		/* Drain. */
+	}
+
+	dispatch_calls();
+
+	return TRUE;
+}
+
+static void *worker_main(void *data)
+{
+	int sync;
+	struct worker_job *job;
+
+	for (;;) {
+		job = g_async_queue_pop(worker_jobs);
+		if (!job->func) {
+			/* Quit job. */
+			free(job);
+			break;
+		}
+
+		current_job = job;
+		job->func(job->data);
+		current_job = NULL;
+
+		/*
+		 * The release goes through the main loop queue so it happens after
+		 * the calls deferred by the job. An async job can be freed as soon as
+		 * it is pushed, a sync one not before done is set since the waiting
+		 * main loop dispatches the calls only then.
+		 */
+		sync = job->sync;
+		push_call(NULL, job, job_done);
+
+		if (sync) {
+			pthread_mutex_lock(&sync_lock);
+			job->done = 1;
+			pthread_cond_broadcast(&sync_cond);
+			pthread_mutex_unlock(&sync_lock);
+		}
+	}
+
+	return NULL;
+}
+
+static int set_nonblock(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0) {
+		return -1;
+	}
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Start the worker thread.
+ *
+ * Return 0 on success or else a negative value. Jobs are then run in the
+ * main loop but, if the wakeup pipe is up, other threads can still notify it.
+ */
+int worker_init(void)
+{
+	int ret;
+	GIOChannel *channel;
+
+	ret = pipe(wakeup_fds);
+	if (ret < 0) {
+		IRSSI_MSG("Unable to create worker pipe: %s", strerror(errno));
+		goto error_pipe;
+	}
+
+	if (set_nonblock(wakeup_fds[0]) < 0 || set_nonblock(wakeup_fds[1]) < 0) {
+		IRSSI_MSG("Unable to set up worker pipe: %s", strerror(errno));
+		goto error;
+	}
+
+	worker_jobs = g_async_queue_new();
+	worker_calls = g_async_queue_new();
+
+	channel = g_io_channel_unix_new(wakeup_fds[0]);
+	wakeup_source = g_io_add_watch(channel, G_IO_IN, wakeup_cb, NULL);
+	g_io_channel_unref(channel);
+
+	ret = pthread_create(&worker_thread, NULL, worker_main, NULL);
+	if (ret != 0) {
+		IRSSI_MSG("Unable to start worker thread: %s", strerror(ret));
+		/* The pipe is kept for worker_notify(). */
+		return -1;
+	}
+
+	worker_running = 1;
+	IRSSI_DEBUG("Worker thread started");
+
+	return 0;
+
+error:
+	close(wakeup_fds[0]);
+	close(wakeup_fds[1]);
+	wakeup_fds[0] = wakeup_fds[1] = -1;
+error_pipe:
+	return -1;
+}
+
+/*
+ * Stop the worker once the pending jobs are done and run what they deferred.
+ */
+void worker_deinit(void)
+{
+	struct worker_job *quit;
+
+	if (!worker_calls) {
+		return;
+	}
+
+	if (worker_running) {
+		quit = zmalloc(sizeof(*quit));
+		assert(quit);
+		g_async_queue_push(worker_jobs, quit);
+		pthread_join(worker_thread, NULL);
+		worker_running = 0;
+	}
+
+	dispatch_calls();
+
+	g_source_remove(wakeup_source);
+	wakeup_source = 0;
+	close(wakeup_fds[0]);
+	close(wakeup_fds[1]);
+	wakeup_fds[0] = wakeup_fds[1] = -1;
+
+	g_async_queue_unref(worker_jobs);
+	g_async_queue_unref(worker_calls);
+	worker_jobs = worker_calls = NULL;
+
+	IRSSI_DEBUG("Worker thread stopped");
+}
+
+/*
+ * Return 1 if called from the worker thread.
+ */
+int worker_in_thread(void)
+{
+	return worker_running && pthread_equal(pthread_self(), worker_thread);
+}
+
+/*
+ * Return the job being run by the worker or NULL.
+ */
+const struct worker_job *worker_current_job(void)
+{
+	return worker_in_thread() ? current_job : NULL;
+}
+
+/*
+ * Allocate a job. The caller fills the snapshot and posts it.
+ */
+struct worker_job *worker_job_new(worker_func_t func, void *data,
+		worker_func_t free_data)
+{
+	struct worker_job *job;
+
+	assert(func);
+
+	job = zmalloc(sizeof(*job));
+	if (!job) {
+		goto error;
+	}
+
+	job->func = func;
+	job->data = data;
+	job->free_data = free_data;
+
+error:
+	return job;
+}
+
+/*
+ * Post a job to the worker. Called from the main loop which owns the job from
+ * now on. Without worker, the job is run right away.
+ */
+void worker_post(struct worker_job *job)
+{
+	assert(job);
+
+	if (job->server) {
+		server_ref(job->server);
+	}
+
+	if (!worker_running) {
+		job->func(job->data);
+		job_done(job);
+		return;
+	}
+
+	g_async_queue_push(worker_jobs, job);
+}
+
+/*
+ * Run func on the worker and wait for it. The main loop being blocked, the
+ * job can safely look at Irssi objects. Used on quit and unload.
+ */
+void worker_sync(worker_func_t func, void *data)
+{
+	struct worker_job *job;
+
+	if (!worker_running) {
+		func(data);
+		return;
+	}
+
+	job = worker_job_new(func, data, NULL);
+	if (!job) {
+		return;
+	}
+	job->sync = 1;
+
+	g_async_queue_push(worker_jobs, job);
+
+	pthread_mutex_lock(&sync_lock);
+	while (!job->done) {
+		pthread_cond_wait(&sync_cond, &sync_lock);
+	}
+	pthread_mutex_unlock(&sync_lock);
+
+	/* This also releases the job. */
+	dispatch_calls();
+}
+
+/*
+ * Run func in the main loop. From the main loop, it is run right away.
+ */
+void worker_defer(worker_func_t func, void *data, worker_func_t free_data)
+{
+	if (!worker_in_thread()) {
+		func(data);
+		if (free_data) {
+			free_data(data);
+		}
+		return;
+	}
+
+	push_call(func, data, free_data);
+}
+
+/*
+ * Run func in the main loop from any thread, for instance one not managed by
+ * the worker. Return 0 on success or else a negative value if the main loop
+ * can't be woken up, data is then left to the caller.
+ */
+int worker_notify(worker_func_t func, void *data, worker_func_t free_data)
+{
+	if (!worker_calls) {
+		return -1;
+	}
+
+	push_call(func, data, free_data);
+
+	return 0;
+}
+
+/*
+ * Format arguments the way printtext() does. Only the printf conversions
+ * known by Irssi are handled and the other codes (colors) are kept as is for
+ * printtext_string(). The '%' of the string arguments (nicks, messages) are
+ * doubled so printtext_string() doesn't take them for color codes.
+ */
+static char *format_args(const char *fmt, va_list ap)
+{
+	GString *out;
+
+	out = g_string_new(NULL);
+
+	for (; *fmt != '\0'; fmt++) {
+		if (*fmt != '%') {
+			g_string_append_c(out, *fmt);
+			continue;
+		}
+
+		if (*++fmt == '\0') {
+			break;
+		}
+
+		switch (*fmt) {
+		case 's':
+		{
+			const char *s = va_arg(ap, const char *);
+			for (; s && *s != '\0'; s++) {
+				if (*s == '%') {
+					g_string_append_c(out, '%');
+				}
+				g_string_append_c(out, *s);
+			}
+			break;
+		}
+		case 'd':
+			g_string_append_printf(out, "%d", va_arg(ap, int));
+			break;
+		case 'u':
+			g_string_append_printf(out, "%u", va_arg(ap, unsigned int));
+			break;
+		case 'f':
+			g_string_append_printf(out, "%0.2f", va_arg(ap, double));
+			break;
+		case 'l':
+			if (*(fmt + 1) == 'u') {
+				fmt++;
+				g_string_append_printf(out, "%lu",
+						va_arg(ap, unsigned long));
+			} else {
+				if (*(fmt + 1) == 'd') {
+					fmt++;
+				}
+				g_string_append_printf(out, "%ld", va_arg(ap, long));
+			}
+			break;
+		default:
+			g_string_append_c(out, '%');
+			g_string_append_c(out, *fmt);
+			break;
+		}
+	}
+
+	return g_string_free(out, FALSE);
+}
+
+static void print_call(void *data)
+{
+	struct worker_print *print = data;
+
+	printtext_string(print->server, print->target, print->level, print->text);
+}
+
+static void print_free(void *data)
+{
+	struct worker_print *print = data;
+
+	free(print->target);
+	g_free(print->text);
+	free(print);
+}
+
+/*
+ * printtext() for the worker. The text is formatted on the worker and printed
+ * by the main loop. The server record is kept alive by the job.
+ */
+void worker_printtext(void *server, const char *target, int level,
+		const char *fmt, ...)
+{
+	va_list ap;
+	struct worker_print *print;
+
+	print = zmalloc(sizeof(*print));
+	if (!print) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	print->text = format_args(fmt, ap);
+	va_end(ap);
+
+	print->server = server;
+	print->target = target ? strdup(target) : NULL;
+	print->level = level;
+
+	worker_defer(print_call, print, print_free);
+}
@@ -0,0 +1,71 @@
+/*
+ * Off-the-Record Messaging (OTR) modules for IRC
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301,USA
+ */
+
+#ifndef IRSSI_OTR_WORKER_H
+#define IRSSI_OTR_WORKER_H
+
+/*
+ * The OTR user state and every libotr call live on a single worker thread so
+ * the crypto (AKE, SMP, signatures) never blocks the Irssi main loop.
+ *
+ * Signal handlers post jobs to the worker. Anything touching Irssi from a job
+ * (printing, sending, signals, statusbar) is deferred back to the main loop
+ * which is woken up through a pipe. Jobs and deferred calls are both handled
+ * in FIFO order so the order of the messages of a peer is preserved.
+ */
+
+typedef void (*worker_func_t)(void *data);
+
+/*
+ * Job run on the worker thread.
+ *
+ * The Irssi objects are snapshot in the main loop when the job is posted
+ * since the worker must not touch them while the main loop runs.
+ */
+struct worker_job {
+	worker_func_t func;
+	void *data;
+	/* Called in the main loop to release data once the job is done. */
+	worker_func_t free_data;
+	/* Server record, referenced until the job is done. May be NULL. */
+	void *server;
+	/* Interned account name of the server. */
+	const char *accname;
+	/* Peer of the job and the maximum message size to use with it. */
+	char *target;
+	int max_msg_size;
+	/* Set if the main loop is blocked waiting for the job. */
+	int sync;
+	int done;
+};
+
+int worker_init(void);
+void worker_deinit(void);
+int worker_in_thread(void);
+const struct worker_job *worker_current_job(void);
+
+struct worker_job *worker_job_new(worker_func_t func, void *data,
+		worker_func_t free_data);
+void worker_post(struct worker_job *job);
+void worker_sync(worker_func_t func, void *data);
+void worker_defer(worker_func_t func, void *data, worker_func_t free_data);
+int worker_notify(worker_func_t func, void *data, worker_func_t free_data);
+void worker_printtext(void *server, const char *target, int level,
+		const char *fmt, ...);
+
+#endif /* IRSSI_OTR_WORKER_H */